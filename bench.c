@@ -0,0 +1,771 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>      // for PATH_MAX
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sched.h>       // for sched_yield
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "scarymalloc.h" // just for the trace format
+
+/*
+   Allocator benchmarks. Every workload runs in a fresh process, once with
+   the system allocator and once with each .so given with -a (loaded with
+   LD_PRELOAD, same as you'd use it), and gets one line each:
+
+    - calls per second, over all threads, wall clock
+    - median, 99th and 99.9th percentile time of one malloc/free/realloc
+    - peak RSS over what the process had before the workload started
+    - fragmentation: that RSS over the most bytes the workload ever had
+      allocated at once. 1.0 would be perfect; the timing and bookkeeping
+      arrays count against it too, but the same for every allocator
+
+   Nothing the harness needs for itself comes from malloc, so all of that
+   is the allocator under test.
+*/
+
+#define MAX_THREADS 64
+#define MAX_ALLOCATORS 8
+#define DEFAULT_CALLS 400000   // per thread
+#define PEAK_INTERVAL 1024     // calls between looking at the total live bytes
+
+/*
+   Latency histogram. Below HIST_EXACT nanoseconds every value gets its own
+   bucket; past that, every power of two is cut into HIST_SLICES, so a
+   percentile is never off by more than an eighth. (Same idea as the
+   allocator's buckets.)
+*/
+#define HIST_EXACT 64
+#define HIST_SLICES 8
+#define HIST_BUCKETS (HIST_EXACT + (64 - 6)*HIST_SLICES)
+
+typedef struct threadResult_t {
+    uint64_t hist[HIST_BUCKETS];
+    uint64_t calls;
+    int64_t live;        // bytes allocated minus freed by this thread
+    uint64_t rng;
+} threadResult;
+
+typedef struct workload_t {
+    const char* name;
+    void (*run)(threadResult* r, int id);
+    const char* about;
+} workload;
+
+/////////////////////////
+// GLOBAL VARS
+/////////////////////////
+
+int numThreads = 4;
+uint64_t numCalls = DEFAULT_CALLS;
+uint64_t seed = 1;
+const char* traceFile = 0;
+
+threadResult results[MAX_THREADS];
+int64_t peakLive = 0;
+pthread_barrier_t roundBarrier;
+
+/////////////////////////
+// HARNESS
+/////////////////////////
+
+void* benchAlloc(size_t s) {
+    // for the harness's own arrays, so they stay out of the allocator
+    void* p = mmap(0, s, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return p;
+}
+
+uint64_t nowNs(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000 + t.tv_nsec;
+}
+
+uint64_t nextRandom(threadResult* r) {
+    // xorshift64*
+    r->rng ^= r->rng >> 12;
+    r->rng ^= r->rng << 25;
+    r->rng ^= r->rng >> 27;
+    return r->rng * 0x2545f4914f6cdd1dull;
+}
+
+size_t uniformSize(threadResult* r, size_t lo, size_t hi) {
+    return lo + nextRandom(r) % (hi - lo + 1);
+}
+
+size_t logUniformSize(threadResult* r, size_t lo, size_t hi) {
+    // every power of two between lo and hi is equally likely, so small
+    // sizes are common and big ones aren't rare
+    int bits = 63 - __builtin_clzl(hi/lo);
+    size_t s = lo << (nextRandom(r) % (bits + 1));
+    s += nextRandom(r) % s;
+    return s > hi ? hi : s;
+}
+
+int histIndex(uint64_t ns) {
+    if(ns < HIST_EXACT) {
+        return (int)ns;
+    }
+    int f = 63 - __builtin_clzl(ns);
+    return HIST_EXACT + (f - 6)*HIST_SLICES + (int)((ns >> (f - 3)) & (HIST_SLICES - 1));
+}
+
+uint64_t histValue(int i) {
+    // the smallest latency that goes in bucket i
+    if(i < HIST_EXACT) {
+        return i;
+    }
+    int f = (i - HIST_EXACT)/HIST_SLICES + 6;
+    uint64_t slice = (i - HIST_EXACT) % HIST_SLICES;
+    return (1ull << f) + (slice << (f - 3));
+}
+
+void updatePeak(void) {
+    // every PEAK_INTERVAL calls, and once more when a thread's done with
+    // its run but hasn't freed everything yet, so short runs get one too
+    int i;
+    int64_t live = 0;
+    for(i=0; i<numThreads; ++i) {
+        live += __atomic_load_n(&results[i].live, __ATOMIC_RELAXED);
+    }
+    int64_t peak = __atomic_load_n(&peakLive, __ATOMIC_RELAXED);
+    while(live > peak && !__atomic_compare_exchange_n(&peakLive, &peak, live, 1,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        // peak got reloaded, try again
+    }
+}
+
+void record(threadResult* r, uint64_t start, int64_t liveChange) {
+    r->hist[histIndex(nowNs() - start)]++;
+    __atomic_store_n(&r->live, r->live + liveChange, __ATOMIC_RELAXED);
+    if(++r->calls % PEAK_INTERVAL == 0) {
+        updatePeak();
+    }
+}
+
+void touch(char* p, size_t s) {
+    // the program would use its memory, so fault it in. once per page is
+    // enough for RSS; the rest would just time memset
+    size_t i;
+    for(i=0; i<s; i+=4096) {
+        p[i] = (char)i;
+    }
+    if(s) {
+        p[s - 1] = 1;
+    }
+}
+
+void* timedMalloc(threadResult* r, size_t s) {
+    uint64_t start = nowNs();
+    void* p = malloc(s);
+    record(r, start, p ? (int64_t)s : 0);
+    if(p) {
+        touch(p, s);
+    }
+    return p;
+}
+
+void timedFree(threadResult* r, void* p, size_t s) {
+    uint64_t start = nowNs();
+    free(p);
+    record(r, start, p ? -(int64_t)s : 0);
+}
+
+/////////////////////////
+// WORKLOADS
+/////////////////////////
+
+void ring(threadResult* r, size_t slots, size_t lo, size_t hi, int logUniform, uint64_t calls) {
+    // like test.c: keep replacing random slots with new blocks
+    void** ptrs = benchAlloc(slots*sizeof(void*));
+    size_t* sizes = benchAlloc(slots*sizeof(size_t));
+    uint64_t c;
+    size_t i;
+    for(c=0; c<calls/2; ++c) {
+        i = nextRandom(r) % slots;
+        if(ptrs[i]) {
+            timedFree(r, ptrs[i], sizes[i]);
+        }
+        sizes[i] = logUniform ? logUniformSize(r, lo, hi) : uniformSize(r, lo, hi);
+        ptrs[i] = timedMalloc(r, sizes[i]);
+    }
+    updatePeak();
+    for(i=0; i<slots; ++i) {
+        if(ptrs[i]) {
+            timedFree(r, ptrs[i], sizes[i]);
+        }
+    }
+    munmap(ptrs, slots*sizeof(void*));
+    munmap(sizes, slots*sizeof(size_t));
+}
+
+void tinyWorkload(threadResult* r, int id) {
+    (void)id;
+    ring(r, 1000, 8, 128, 0, numCalls);
+}
+
+void mixedWorkload(threadResult* r, int id) {
+    (void)id;
+    ring(r, 4000, 8, 64*1024, 1, numCalls);
+}
+
+void largeWorkload(threadResult* r, int id) {
+    // every one of these faults in a lot of pages, so do fewer
+    (void)id;
+    ring(r, 32, 64*1024, 4*1024*1024, 1, numCalls/64);
+}
+
+/*
+   Producer/consumer: threads pair up, and each producer hands everything
+   it allocates to its consumer to free, through a single-producer,
+   single-consumer ring.
+*/
+#define QUEUE_SIZE 4096
+
+typedef struct queue_t {
+    void* ptrs[QUEUE_SIZE];
+    size_t sizes[QUEUE_SIZE];
+    uint64_t head;       // next to push, only the producer writes it
+    char pad[64];
+    uint64_t tail;       // next to pop, only the consumer writes it
+} queue;
+
+queue* queues = 0;
+
+void prodConsWorkload(threadResult* r, int id) {
+    queue* q = &queues[id/2];
+    uint64_t c;
+    if(id % 2 == 0) {
+        for(c=0; c<=numCalls; ++c) {
+            // the last one is a 0, to say we're done
+            size_t s = uniformSize(r, 16, 1024);
+            void* p = c < numCalls ? timedMalloc(r, s) : 0;
+            while(q->head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == QUEUE_SIZE) {
+                sched_yield();
+            }
+            q->ptrs[q->head % QUEUE_SIZE] = p;
+            q->sizes[q->head % QUEUE_SIZE] = s;
+            __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+        }
+        updatePeak();
+    } else {
+        for(;;) {
+            while(__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == q->tail) {
+                sched_yield();
+            }
+            void* p = q->ptrs[q->tail % QUEUE_SIZE];
+            size_t s = q->sizes[q->tail % QUEUE_SIZE];
+            __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+            if(!p) {
+                break;
+            }
+            timedFree(r, p, s);
+        }
+    }
+}
+
+void reallocWorkload(threadResult* r, int id) {
+    // buffers that keep growing by half, like a vector, till they hit
+    // 1 MB and start over
+    const size_t slots = 64;
+    void** ptrs = benchAlloc(slots*sizeof(void*));
+    size_t* sizes = benchAlloc(slots*sizeof(size_t));
+    uint64_t c;
+    size_t i;
+    (void)id;
+    for(c=0; c<numCalls; ++c) {
+        i = nextRandom(r) % slots;
+        size_t s = sizes[i] ? sizes[i] + sizes[i]/2 : 16;
+        if(s > 1024*1024) {
+            timedFree(r, ptrs[i], sizes[i]);
+            ptrs[i] = 0;
+            sizes[i] = 0;
+            continue;
+        }
+        uint64_t start = nowNs();
+        void* p = realloc(ptrs[i], s);
+        if(!p) {
+            record(r, start, 0);
+            continue;
+        }
+        record(r, start, (int64_t)s - (int64_t)sizes[i]);
+        touch((char*)p + sizes[i], s - sizes[i]);
+        ptrs[i] = p;
+        sizes[i] = s;
+    }
+    updatePeak();
+    for(i=0; i<slots; ++i) {
+        if(ptrs[i]) {
+            timedFree(r, ptrs[i], sizes[i]);
+        }
+    }
+}
+
+/*
+   Larson-style churn: every thread replaces random blocks in an array of
+   its own, but between rounds the arrays move on to the next thread, so
+   most frees are of some other thread's blocks.
+*/
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 20
+
+void** larsonPtrs = 0;
+size_t* larsonSizes = 0;
+
+void larsonWorkload(threadResult* r, int id) {
+    int round;
+    uint64_t c;
+    size_t i;
+    for(round=0; round<LARSON_ROUNDS; ++round) {
+        size_t base = (size_t)((id + round) % numThreads)*LARSON_SLOTS;
+        void** ptrs = larsonPtrs + base;
+        size_t* sizes = larsonSizes + base;
+        for(c=0; c<numCalls/2/LARSON_ROUNDS; ++c) {
+            i = nextRandom(r) % LARSON_SLOTS;
+            if(ptrs[i]) {
+                timedFree(r, ptrs[i], sizes[i]);
+            }
+            sizes[i] = uniformSize(r, 16, 512);
+            ptrs[i] = timedMalloc(r, sizes[i]);
+        }
+        pthread_barrier_wait(&roundBarrier);
+    }
+    // everyone's done with the arrays now, so clean up our last one
+    updatePeak();
+    size_t base = (size_t)((id + LARSON_ROUNDS - 1) % numThreads)*LARSON_SLOTS;
+    for(i=0; i<LARSON_SLOTS; ++i) {
+        if(larsonPtrs[base + i]) {
+            timedFree(r, larsonPtrs[base + i], larsonSizes[base + i]);
+        }
+    }
+}
+
+/*
+   Replay of a trace from scarymalloc-trace.so (see scarymalloc.h), on one
+   thread, in time order. Recorded pointers are mapped to the ones we got
+   back with an open addressing table.
+*/
+typedef struct replayEntry_t {
+    uint64_t recorded;   // 0 if empty
+    void* ptr;
+    size_t size;
+} replayEntry;
+
+replayEntry* replayTable = 0;
+uint64_t replayMask = 0;
+
+replayEntry* replayFind(uint64_t recorded) {
+    // the entry for recorded, or the empty one where it would go
+    uint64_t i = (recorded >> 4) * 0x9e3779b97f4a7c15ull;
+    for(i &= replayMask; replayTable[i].recorded && replayTable[i].recorded != recorded;
+            i = (i + 1) & replayMask) {
+    }
+    return &replayTable[i];
+}
+
+void replayRemove(replayEntry* e) {
+    // shift anything after it back, so no lookup stops early
+    uint64_t i = e - replayTable;
+    uint64_t j = i;
+    for(;;) {
+        j = (j + 1) & replayMask;
+        if(!replayTable[j].recorded) {
+            break;
+        }
+        uint64_t home = ((replayTable[j].recorded >> 4) * 0x9e3779b97f4a7c15ull) & replayMask;
+        // move j into the hole at i if its home isn't between i and j
+        if(((j - home) & replayMask) >= ((j - i) & replayMask)) {
+            replayTable[i] = replayTable[j];
+            i = j;
+        }
+    }
+    replayTable[i].recorded = 0;
+}
+
+void sortEvents(scaryTraceEvent* events, size_t n) {
+    // by time, stably. every thread's events are in order already, so a
+    // bottom-up merge sort it is
+    scaryTraceEvent* tmp = benchAlloc(n*sizeof(scaryTraceEvent));
+    scaryTraceEvent* from = events;
+    scaryTraceEvent* to = tmp;
+    size_t width, i;
+    for(width=1; width<n; width*=2) {
+        for(i=0; i<n; i+=2*width) {
+            size_t a = i, aEnd = i + width < n ? i + width : n;
+            size_t b = aEnd, bEnd = i + 2*width < n ? i + 2*width : n;
+            size_t k = i;
+            while(a < aEnd && b < bEnd) {
+                to[k++] = from[b].time < from[a].time ? from[b++] : from[a++];
+            }
+            while(a < aEnd) {
+                to[k++] = from[a++];
+            }
+            while(b < bEnd) {
+                to[k++] = from[b++];
+            }
+        }
+        scaryTraceEvent* t = from;
+        from = to;
+        to = t;
+    }
+    if(from != events) {
+        memcpy(events, from, n*sizeof(scaryTraceEvent));
+    }
+    munmap(tmp, n*sizeof(scaryTraceEvent));
+}
+
+void replayWorkload(threadResult* r, int id) {
+    (void)id;
+    int fd = open(traceFile, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st)) {
+        perror(traceFile);
+        exit(1);
+    }
+    size_t n = st.st_size/sizeof(scaryTraceEvent);
+    if(!n) {
+        return;
+    }
+    scaryTraceEvent* events = mmap(0, n*sizeof(scaryTraceEvent), PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(events == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    sortEvents(events, n);
+    size_t tableSize = 16;
+    while(tableSize < 2*n) {
+        tableSize *= 2;
+    }
+    replayTable = benchAlloc(tableSize*sizeof(replayEntry));
+    replayMask = tableSize - 1;
+    size_t i;
+    for(i=0; i<n; ++i) {
+        scaryTraceEvent* e = &events[i];
+        replayEntry* old = e->old ? replayFind(e->old) : 0;
+        void* p = 0;
+        uint64_t start;
+        switch(e->op) {
+        case SCARY_TRACE_MALLOC:
+        case SCARY_TRACE_CALLOC:
+            start = nowNs();
+            p = e->op == SCARY_TRACE_MALLOC ? malloc(e->size) : calloc(1, e->size);
+            record(r, start, p ? (int64_t)e->size : 0);
+            break;
+        case SCARY_TRACE_MEMALIGN:
+            start = nowNs();
+            if(posix_memalign(&p, e->old, e->size)) {
+                p = 0;
+            }
+            record(r, start, p ? (int64_t)e->size : 0);
+            old = 0;   // old is the alignment, not a pointer
+            break;
+        case SCARY_TRACE_FREE: {
+            replayEntry* freed = replayFind(e->ptr);
+            if(freed->recorded) {
+                timedFree(r, freed->ptr, freed->size);
+                replayRemove(freed);
+            }
+            continue;
+        }
+        case SCARY_TRACE_REALLOC:
+            if(e->old && !old->recorded) {
+                continue;   // never saw that one get allocated
+            }
+            start = nowNs();
+            p = realloc(old ? old->ptr : 0, e->size);
+            record(r, start, (int64_t)(p ? e->size : 0) - (int64_t)(old ? old->size : 0));
+            if(old) {
+                replayRemove(old);
+            }
+            break;
+        default:
+            continue;
+        }
+        if(p) {
+            touch(p, e->size);
+        }
+        if(p && e->ptr) {
+            replayEntry* added = replayFind(e->ptr);
+            if(added->recorded) {
+                // the trace lost a free somewhere; forget the old one
+                timedFree(r, added->ptr, added->size);
+            }
+            added->recorded = e->ptr;
+            added->ptr = p;
+            added->size = e->size;
+        }
+    }
+    updatePeak();
+    for(i=0; i<tableSize; ++i) {
+        if(replayTable[i].recorded) {
+            timedFree(r, replayTable[i].ptr, replayTable[i].size);
+        }
+    }
+}
+
+workload workloads[] = {
+    {"tiny", tinyWorkload, "8 to 128 bytes, uniformly"},
+    {"mixed", mixedWorkload, "8 bytes to 64 KB, log-uniformly"},
+    {"large", largeWorkload, "64 KB to 4 MB, log-uniformly, 1/64 as many calls"},
+    {"prodcons", prodConsWorkload, "pairs of threads, one mallocs and the other frees"},
+    {"realloc", reallocWorkload, "buffers growing by half up to 1 MB"},
+    {"larson", larsonWorkload, "random churn, arrays passed between threads"},
+    {"replay", replayWorkload, "a trace from -r, on one thread"},
+};
+#define NUM_WORKLOADS (sizeof(workloads)/sizeof(workloads[0]))
+
+/////////////////////////
+// RUNNING THINGS
+/////////////////////////
+
+typedef struct threadArg_t {
+    workload* w;
+    int id;
+} threadArg;
+
+void* workloadThread(void* arg) {
+    threadArg* a = arg;
+    a->w->run(&results[a->id], a->id);
+    return 0;
+}
+
+long rssKb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+void runWorkload(workload* w) {
+    // the child side: run w, print one line of raw numbers for the parent
+    pthread_t threads[MAX_THREADS];
+    threadArg args[MAX_THREADS];
+    int i, j;
+    if(w->run == prodConsWorkload) {
+        numThreads += numThreads % 2;
+        queues = benchAlloc((numThreads/2)*sizeof(queue));
+    } else if(w->run == larsonWorkload) {
+        larsonPtrs = benchAlloc(numThreads*LARSON_SLOTS*sizeof(void*));
+        larsonSizes = benchAlloc(numThreads*LARSON_SLOTS*sizeof(size_t));
+    } else if(w->run == replayWorkload) {
+        numThreads = 1;
+    }
+    pthread_barrier_init(&roundBarrier, 0, numThreads);
+    for(i=0; i<numThreads; ++i) {
+        results[i].rng = seed*0x9e3779b97f4a7c15ull + i + 1;
+    }
+    long baseRss = rssKb();
+    uint64_t start = nowNs();
+    for(i=0; i<numThreads; ++i) {
+        args[i].w = w;
+        args[i].id = i;
+        pthread_create(&threads[i], 0, workloadThread, &args[i]);
+    }
+    for(i=0; i<numThreads; ++i) {
+        pthread_join(threads[i], 0);
+    }
+    double seconds = (nowNs() - start)/1e9;
+    long peakRss = rssKb();
+    // add up the histograms, then find the percentiles
+    uint64_t calls = 0;
+    for(i=0; i<numThreads; ++i) {
+        calls += results[i].calls;
+        if(i) {
+            for(j=0; j<HIST_BUCKETS; ++j) {
+                results[0].hist[j] += results[i].hist[j];
+            }
+        }
+    }
+    double wanted[3] = {0.5, 0.99, 0.999};
+    uint64_t pct[3] = {0, 0, 0};
+    uint64_t seen = 0;
+    int k = 0;
+    for(j=0; j<HIST_BUCKETS && k<3; ++j) {
+        seen += results[0].hist[j];
+        while(k < 3 && seen >= wanted[k]*calls && calls) {
+            pct[k++] = histValue(j);
+        }
+    }
+    printf("%" PRIu64 " %f %" PRIu64 " %" PRIu64 " %" PRIu64 " %ld %ld %" PRId64 "\n",
+           calls, seconds, pct[0], pct[1], pct[2], peakRss, baseRss, peakLive);
+}
+
+int runChild(workload* w, const char* lib, char** argv, char* line, size_t len) {
+    // run w in a new process with lib preloaded (or the system allocator,
+    // if lib is 0) and get its line of output
+    int fds[2];
+    if(pipe(fds)) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if(pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if(!pid) {
+        dup2(fds[1], 1);
+        close(fds[0]);
+        close(fds[1]);
+        if(lib) {
+            setenv("LD_PRELOAD", lib, 1);
+        } else {
+            unsetenv("LD_PRELOAD");
+        }
+        setenv("BENCH_WORKLOAD", w->name, 1);
+        execv("/proc/self/exe", argv);
+        perror("execv");
+        _exit(1);
+    }
+    close(fds[1]);
+    size_t got = 0;
+    ssize_t n;
+    while(got + 1 < len && (n = read(fds[0], line + got, len - 1 - got)) > 0) {
+        got += n;
+    }
+    line[got] = 0;
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 && got;
+}
+
+void report(workload* w, const char* name, const char* line) {
+    uint64_t calls, p50, p99, p999;
+    double seconds;
+    long peakRss, baseRss;
+    int64_t live;
+    if(sscanf(line, "%" SCNu64 " %lf %" SCNu64 " %" SCNu64 " %" SCNu64 " %ld %ld %" SCNd64,
+              &calls, &seconds, &p50, &p99, &p999, &peakRss, &baseRss, &live) != 8) {
+        printf("%-9s %-20s failed\n", w->name, name);
+        return;
+    }
+    long rss = peakRss - baseRss;
+    printf("%-9s %-20s %12.0f %7" PRIu64 " %7" PRIu64 " %7" PRIu64 " %10ld ",
+           w->name, name, seconds > 0 ? calls/seconds : 0.0, p50, p99, p999, rss);
+    if(live > 0) {
+        printf("%7.2f\n", rss*1024.0/live);
+    } else {
+        // nothing was ever seen allocated, so there's nothing to divide by
+        printf("%7s\n", "-");
+    }
+    fflush(stdout);
+}
+
+void usage(const char* self) {
+    size_t i;
+    fprintf(stderr, "usage: %s [-t threads] [-n calls] [-s seed] [-a lib.so]... [-r trace] [workload]...\n"
+            "  -t  threads (default 4)\n"
+            "  -n  calls per thread (default %d)\n"
+            "  -a  allocator to compare with the system one, by LD_PRELOAD.\n"
+            "      default ./scarymalloc.so, if it's there\n"
+            "  -r  trace from scarymalloc-trace.so, for the replay workload\n"
+            "workloads (default all, except replay without -r):\n", self, DEFAULT_CALLS);
+    for(i=0; i<NUM_WORKLOADS; ++i) {
+        fprintf(stderr, "  %-9s %s\n", workloads[i].name, workloads[i].about);
+    }
+    exit(1);
+}
+
+workload* findWorkload(const char* name) {
+    size_t i;
+    for(i=0; i<NUM_WORKLOADS; ++i) {
+        if(!strcmp(workloads[i].name, name)) {
+            return &workloads[i];
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    static char libs[MAX_ALLOCATORS][PATH_MAX];
+    int numLibs = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "t:n:s:a:r:h")) != -1) {
+        switch(opt) {
+        case 't':
+            numThreads = atoi(optarg);
+            if(numThreads < 1 || numThreads > MAX_THREADS) {
+                usage(argv[0]);
+            }
+            break;
+        case 'n':
+            numCalls = strtoull(optarg, 0, 0);
+            break;
+        case 's':
+            seed = strtoull(optarg, 0, 0);
+            break;
+        case 'a':
+            // LD_PRELOAD wants a path that works from anywhere
+            if(numLibs == MAX_ALLOCATORS || !realpath(optarg, libs[numLibs])) {
+                usage(argv[0]);
+            }
+            ++numLibs;
+            break;
+        case 'r':
+            traceFile = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    const char* child = getenv("BENCH_WORKLOAD");
+    if(child) {
+        runWorkload(findWorkload(child));
+        return 0;
+    }
+    if(!numLibs && realpath("./scarymalloc.so", libs[0])) {
+        numLibs = 1;
+    }
+    workload* todo[NUM_WORKLOADS];
+    size_t numTodo = 0;
+    size_t i;
+    if(optind < argc) {
+        for(; optind<argc; ++optind) {
+            workload* w = findWorkload(argv[optind]);
+            if(!w || numTodo == NUM_WORKLOADS) {
+                usage(argv[0]);
+            }
+            todo[numTodo++] = w;
+        }
+    } else {
+        for(i=0; i<NUM_WORKLOADS; ++i) {
+            if(workloads[i].run != replayWorkload || traceFile) {
+                todo[numTodo++] = &workloads[i];
+            }
+        }
+    }
+    printf("%d threads, %" PRIu64 " calls each\n", numThreads, numCalls);
+    printf("%-9s %-20s %12s %7s %7s %7s %10s %7s\n", "workload", "allocator", "calls/s",
+           "p50 ns", "p99", "p99.9", "rss KB", "frag");
+    for(i=0; i<numTodo; ++i) {
+        char line[256];
+        int l;
+        if(todo[i]->run == replayWorkload && !traceFile) {
+            usage(argv[0]);
+        }
+        for(l=-1; l<numLibs; ++l) {
+            const char* lib = l < 0 ? 0 : libs[l];
+            const char* name = lib ? strrchr(lib, '/') + 1 : "system";
+            if(!runChild(todo[i], lib, argv, line, sizeof(line))) {
+                line[0] = 0;
+            }
+            report(todo[i], name, line);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+
+# Reads a heap map (what scary_heap_write or SCARYMALLOC_HEAP_MAP writes)
+# from a file, or stdin, and prints how fragmented the heap is: totals for
+# each arena, histograms of free and allocated block sizes, and a strip for
+# every chunk showing where its allocated bytes are.
+#
+#   python3 heapmap.py map.1234.csv
+
+import sys
+from collections import defaultdict
+
+HEADER = 16    # BLOCK_OVERHEAD: every block is its header plus its size
+WIDTH = 64     # characters per chunk strip
+BAR = 40       # characters in the longest histogram bar
+
+# from empty to full
+SHADES = " .:-=+*#%@"
+
+FREE_KINDS = ("free", "top", "fast")
+
+
+class Chunk:
+    def __init__(self, arena, address, size):
+        self.arena = arena
+        self.address = address
+        self.size = size
+        self.blocks = []
+
+
+def readMap(f):
+    chunks = []
+    chunk = None
+    for line in f:
+        line = line.strip()
+        if not line or line.startswith("kind,"):
+            continue
+        kind, arena, address, size, bucket = line.split(",")
+        arena = int(arena)
+        address = int(address, 16)
+        size = int(size)
+        if kind == "chunk":
+            chunk = Chunk(arena, address, size)
+            chunks.append(chunk)
+        elif chunk is not None:
+            chunk.blocks.append((kind, address, size))
+    return chunks
+
+
+def human(n):
+    for unit in ("B", "K", "M", "G"):
+        if n < 1024 or unit == "G":
+            return "%d%s" % (n, unit) if unit == "B" else "%.1f%s" % (n, unit)
+        n /= 1024.0
+
+
+def summary(name, chunks):
+    mapped = sum(c.size for c in chunks)
+    allocated = []
+    free = []
+    for c in chunks:
+        for kind, address, size in c.blocks:
+            (free if kind in FREE_KINDS else allocated).append(size)
+    total = sum(free)
+    # same as malloc_stats: how much of the free space isn't in the biggest
+    # free block
+    frag = 1.0 - float(max(free)) / total if total else 0.0
+    print("%s: %d chunks, %s mapped, %d allocated blocks (%s), "
+          "%d free blocks (%s), fragmentation %.1f%%" % (
+              name, len(chunks), human(mapped),
+              len(allocated), human(sum(allocated)),
+              len(free), human(total), frag*100))
+
+
+def histogram(title, sizes):
+    if not sizes:
+        return
+    # by power of two: bin n has the sizes in [2^n, 2^(n+1))
+    bins = defaultdict(lambda: [0, 0])
+    for s in sizes:
+        b = bins[max(s, 1).bit_length() - 1]
+        b[0] += 1
+        b[1] += s
+    most = max(b[1] for b in bins.values()) or 1
+    print()
+    print("%s (count, bytes):" % title)
+    for n in sorted(bins):
+        count, total = bins[n]
+        bar = "#" * max(1, int(round(BAR * total / most))) if total else ""
+        print("  %8s %8d %8s %s" % (human(1 << n), count, human(total), bar))
+
+
+def strip(chunk):
+    # how many allocated bytes land in each character's slice of the chunk
+    used = [0.0] * WIDTH
+    step = chunk.size / float(WIDTH)
+    for kind, address, size in chunk.blocks:
+        if kind in FREE_KINDS:
+            continue
+        start = address - chunk.address
+        end = start + size + HEADER
+        i = int(start / step)
+        while i < WIDTH and i*step < end:
+            lo = max(start, i*step)
+            hi = min(end, (i + 1)*step)
+            used[i] += hi - lo
+            i += 1
+    return "".join(SHADES[min(len(SHADES) - 1,
+                              int(u / step * (len(SHADES) - 1) + 0.999))]
+                   for u in used)
+
+
+def main():
+    if len(sys.argv) > 1:
+        with open(sys.argv[1]) as f:
+            chunks = readMap(f)
+    else:
+        chunks = readMap(sys.stdin)
+    if not chunks:
+        print("no chunks in the map")
+        return
+
+    arenas = sorted(set(c.arena for c in chunks))
+    for a in arenas:
+        summary("arena %d" % a, [c for c in chunks if c.arena == a])
+    if len(arenas) > 1:
+        summary("total", chunks)
+
+    free = [s for c in chunks for k, _, s in c.blocks if k in FREE_KINDS]
+    allocated = [s for c in chunks for k, _, s in c.blocks if k not in FREE_KINDS]
+    histogram("free blocks", free)
+    histogram("allocated blocks", allocated)
+
+    print()
+    print("chunks ('%s' is empty, '%s' is full):" % (SHADES[0], SHADES[-1]))
+    for c in chunks:
+        print("  %d %#x %8s |%s|" % (c.arena, c.address, human(c.size), strip(c)))
+
+
+if __name__ == "__main__":
+    main()
@@ -1,101 +1,490 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stddef.h>    // for offsetof
 #include <inttypes.h>
 #include <string.h>    // for memset
+#include <stdlib.h>    // for getenv, atoi
+#include <stdarg.h>
+#include <malloc.h>    // for struct mallinfo2
+#include <pthread.h>
+#include <sched.h>     // for sched_getcpu
+#include <sys/mman.h>
+#include <time.h>      // for clock_gettime, nanosleep
+#include <fcntl.h>     // for open and fcntl, for the trace and stats files
+#include <signal.h>
+#include <execinfo.h>  // for backtrace
+#include "scarymalloc.h"
 
 /////////////////////////
 // CONSTANTS/TYPES
 /////////////////////////
 
-#define NUMBUCKETS 32 // can't go too far above bit size... be pessimistic
-#define MIN_PHYSICAL_BLOCK 0x100   // whatever
+// two-level bucket index, see arena below
+#define SL_INDEX_LOG2 4            // each power of two range is cut into 16 buckets
+#define SL_INDEX_COUNT (1 << SL_INDEX_LOG2)
+#define FL_INDEX_SHIFT 8           // SL_INDEX_LOG2 + log2(ALIGNMENT)
+#define SMALL_BLOCK_SIZE (1ul << FL_INDEX_SHIFT)  // below this it's all in first level 0
+#define FL_INDEX_MAX 40            // anything 2^40 and up goes in the very last bucket
+#define FL_INDEX_COUNT (FL_INDEX_MAX - FL_INDEX_SHIFT + 1)
+#define MIN_CHUNK_SIZE (64*1024)   // the first chunk an arena maps...
+#define MAX_CHUNK_SIZE (32*1024*1024)  // ...and each one after that is twice as big, up to this
+#define MAX_ARENAS 64
 
+// per-thread cache of small blocks, see threadCache below
+#define TCACHE_MAX_SIZE 1024  // biggest payload size the thread cache will hold
+#define TCACHE_BINS 64        // TCACHE_MAX_SIZE/ALIGNMENT, one bin per size
+#define TCACHE_BATCH 16       // blocks moved to/from the arena at a time
+#define TCACHE_LIMIT 64       // most blocks a bin holds before it gets flushed
+
+// recently freed blocks that aren't coallesced yet, see fastBins in arena
+#define FASTBIN_MAX_SIZE 4096          // biggest payload that goes in a fast bin
+#define FASTBIN_COUNT 256              // FASTBIN_MAX_SIZE/ALIGNMENT, one bin per size
+#define FASTBIN_MAX_BYTES (256*1024)   // more than this in an arena's fast bins, and they're all coallesced
+
+// blocks regions bump through, see scaryRegion below
+#define REGION_MIN_BLOCK (64*1024)        // a region's first block...
+#define REGION_MAX_BLOCK (4*1024*1024)    // ...and each one after that is twice as big, up to this
+
+// small objects live in slabs instead of blocks, see slab below
+#define SLAB_SIZE 0x1000          // one page
+#define SLAB_MAX_SIZE 512         // anything bigger goes in the buckets
+#define SLAB_CLASSES 16
+#define SLAB_REGION_SIZE (1ul << 32)  // address space reserved for all slabs
+
+// requests this big get a mapping all to themselves. starts at the low end,
+// and moves up as big blocks are freed, like glibc does
+#define DEFAULT_MMAP_THRESHOLD (128*1024)
+#define MAX_MMAP_THRESHOLD (32*1024*1024)
+
+// how long free pages stay resident before they're given back to the
+// kernel, first lazily (MADV_FREE) and then for real (MADV_DONTNEED)
+#define DEFAULT_DIRTY_DECAY_MS 10000
+#define DEFAULT_MUZZY_DECAY_MS 10000
+
+// with SCARYMALLOC_THP=1, chunks are made of whole transparent huge pages
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+// events in each thread's trace buffer, when built with SCARY_TRACE
+#define TRACE_BUFFER_EVENTS 16384
+
+// heap profiler, see profileSample below
+#define PROFILE_DEPTH 32          // most stack frames kept per sample
+#define PROFILE_SAMPLES 65536     // most samples live at once
+#define PROFILE_BUCKETS 16384     // hash buckets for looking samples up by pointer
+
+// flags in blockHeader.size
 const uintptr_t LOWESTBIT = (1ul);  // & this with something to find if block is allocated
-const uintptr_t HIGHBITS = (~(1ul));
+const uintptr_t MMAPPEDBIT = (2ul); // for blocks with their own mapping
+const uintptr_t PREVFREEBIT = (4ul); // the physically previous block is free
+const uintptr_t SAMPLEDBIT = (8ul);  // the heap profiler has a sample of this block
+const uintptr_t HIGHBITS = (~(0xful));  // everything's 16-aligned, so 4 bits for flags
 
 #define MASKED_VALUE(n) (n & HIGHBITS)
-#define MASKED_PTR(p) ( (blockHeader*)((uintptr_t)p & HIGHBITS) )
 
 const int ALIGNMENT = 16u;  // for 64-bit, apparently
 
+struct arena_t;
+
 /*
-   Header for a memory block.
-   Whether block is allocated is lowest bit of logicalPrev
-   Whether there's a previous physical block to merge with is
-   stored as the lowest bit of size.
-   Whether there's a next physical block is stored as lowest bit
-   of footer size.
-   For all these values, you have to & them with HIGHBITS to get the 
-   value to do actual math with.
+   Header for a memory block. An allocated block is just the first two
+   words, with the payload right after them. Only a free block uses the
+   rest: its free-list links are the first words of its payload, and it
+   has a footer, the last word of its payload, holding its size again.
+   All the flags are in the low bits of size:
+   Whether the block is allocated is the lowest bit.
+   Whether the block is a standalone mmap (see directMalloc) is the
+   second lowest bit. Those blocks have no neighbors, and instead of an
+   arena they have how far before the header the mapping starts, which is
+   only ever nonzero for aligned ones (see directAlignedMalloc).
+   Whether the physically previous block is free, so that there's a footer
+   right before this header to find it with, is the third lowest bit.
+   Whether the heap profiler sampled the block, so free has to tell it,
+   is the fourth.
+   You have to & size with HIGHBITS to get the value to do actual math with.
 */
 typedef struct blockHeader_t {
+    union {
+        struct arena_t* arena;  // owning arena, so free can route the block back
+        size_t mapOffset;       // direct blocks only
+    };
+    size_t size;   // payload size!
+    // free blocks only, from here on
     struct blockHeader_t* logicalPrev;  // previous in size-bucket free-list
     struct blockHeader_t* logicalNext;  // next in... you know
-    size_t size;   // payload size!
-    size_t pad;    // for 16-byte alignment
-} blockHeader; // end of data is the size footer, also size_t
+} blockHeader;
 
 typedef struct blockFooter_t {
-    size_t pad; // we want this struct's size to be a multiple of ALIGNMENT (16),
-                // and we may as well have this otherwise useless eight bytes at the
-                // front as a shield against heap corruption
-    size_t size;
+    size_t size;   // no flags, just the size
 } blockFooter;
 
-#define BLOCK_OVERHEAD (sizeof(blockHeader) + sizeof(blockFooter))
+// what an allocated block costs on top of its payload
+#define BLOCK_OVERHEAD (offsetof(blockHeader, logicalPrev))
+
+// every block's payload has room for what it needs once it's free: the
+// links, the purge info (see below), and the footer, rounded up to 16
+#define MIN_PAYLOAD 48
+
+/*
+   Every free block keeps this at the front of its payload, to remember
+   what's happened to its pages. Dirty pages have been written to and are
+   resident. Muzzy pages have been MADV_FREEd: the kernel can take them if
+   it wants to. Clean pages are gone (MADV_DONTNEED) or were never touched,
+   which is why clean has to be 0: fresh mmap memory is clean already.
+   Only whole pages after this struct and before the footer get purged.
+   It also remembers where the part of the block that's known to be all
+   zeroes starts (see getZeroFrom), so calloc can skip clearing it.
+*/
+typedef struct purgeInfo_t {
+    uint64_t stamp;  // when the block got to its current state, in ms
+    uint64_t state;
+    char* zeroFrom;  // from here to the footer is zero. past it if none is
+} purgeInfo;
 
+#define PURGE_CLEAN 0
+#define PURGE_DIRTY 1
+#define PURGE_MUZZY 2
+
+/*
+   The end of every chunk is a *fence*: a bare header with size 0 that
+   looks allocated, so nothing merges past it, and that keeps the
+   previous-is-free bit for the chunk's last block like any header would.
+*/
 typedef struct memoryChunk_t {
-    size_t size; // size of memory AFTER this struct. again, payload
+    size_t size; // size of memory AFTER this struct, fence and all
     struct memoryChunk_t* older; // put highest-address/latest-allocated chunks at end, so they're
-                                 // easy to muck with if next sbrk is contiguous
+                                 // easy to muck with if next mmap is contiguous
 } memoryChunk;
 
 #define CHUNK_OVERHEAD (sizeof(memoryChunk))
 
-const int FIRSTBUCKETCEILING = (16); //1*ALIGNMENT;
+/*
+   A slab is one SLAB_SIZE page full of objects of a single size class,
+   with no per-object header or footer. This header sits at the start of
+   the page, so the slab for any object is just its address rounded down.
+   All slabs are carved out of one big reserved region, which is how free
+   tells a slab object from a block: it's a range check.
+
+   Objects that have been freed are on freeList, linked through their
+   first word. Objects at index bump and up have never been handed out.
+   A slab with room in it is on its arena's partial list for its class.
+*/
+typedef struct slab_t {
+    struct slab_t* prev;   // in the arena's partial list for sizeClass
+    struct slab_t* next;
+    struct arena_t* arena; // owner, just like blockHeader.arena
+    void* freeList;
+    unsigned int sizeClass;
+    unsigned int used;     // objects currently handed out (or in a thread cache)
+    unsigned int bump;
+    unsigned int capacity;
+    uint64_t freedAt;      // when it went into slabPool, for purging
+} slab;
+
+#define SLAB_HEADER_SIZE ((sizeof(slab) + 15) & ~(size_t)15)
+
+// object size of each class. spaced so the worst case waste is about 20%
+const size_t slabClassSize[SLAB_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512
+};
+
+// class for an aligned size s is slabClassOf[s/ALIGNMENT]
+const unsigned char slabClassOf[SLAB_MAX_SIZE/16 + 1] = {
+    0, 0, 1, 2, 3, 4, 5, 6, 7,          // 0-128, every 16
+    8, 8, 9, 9, 10, 10, 11, 11,         // 144-256, every 32
+    12, 12, 12, 12, 13, 13, 13, 13,     // 272-384, every 64
+    14, 14, 14, 14, 15, 15, 15, 15      // 400-512
+};
+
+/*
+   Counters for one arena, all updated under its lock, so they cost a few
+   adds and no atomics. Blocks sitting in thread caches count as allocated,
+   since as far as the arena knows they are. Blocks are counted in the
+   bucket for their payload size, same as if they were free. Free blocks
+   aren't counted as they come and go; a snapshot just walks the buckets.
+*/
+typedef struct arenaStats_t {
+    size_t allocatedBlocks[FL_INDEX_COUNT][SL_INDEX_COUNT];
+    size_t allocatedBytes[FL_INDEX_COUNT][SL_INDEX_COUNT];
+    size_t slabObjects[SLAB_CLASSES];  // in use, per class
+    size_t slabs;          // pages this arena has as slabs right now
+    size_t chunkBytes;     // mapped for chunks right now, headers and all
+    uint64_t chunkMaps;    // mmap calls for chunks
+    uint64_t chunkExtends; // ...that landed right after the latest chunk
+    uint64_t blockMallocs;
+    uint64_t blockFrees;
+    uint64_t slabMallocs;
+    uint64_t slabFrees;
+    uint64_t searchSteps;  // free blocks findFreeBlock looked at
+    uint64_t splits;
+    uint64_t coallesces;
+} arenaStats;
+
+/*
+   An arena is an independent heap: its own buckets, its own list of
+   physical chunks, and a lock covering both. Threads are spread over
+   the arenas so they don't all fight over one lock. Blocks never move
+   between arenas, since they are only ever coallesced with physical
+   neighbors, which live in the same chunk.
+
+   Buckets are a two level index (TLSF, if you want to look it up).
+   The first level is the power of two of the size, and the second level
+   splits each power of two range into SL_INDEX_COUNT equal slices. Sizes
+   under SMALL_BLOCK_SIZE are all first level 0, sliced every ALIGNMENT
+   bytes. Just to repeat, use the payload size of the object, not
+   including header/footer. Lists within a bucket aren't sorted.
+
+   A bit in flBitmap says a first level has some non-empty bucket, and a
+   bit in slBitmap[fl] says which of its buckets are non-empty, so finding
+   a bucket with a block that fits is a couple of find-first-set ops
+   instead of a search. See findFreeBlock.
+
+   Array is of bucket objects so when first object wants to unlink itself
+   it doesn't have to check special case of being at front.
+
+   CRITICAL that buckets and bitmaps are 0-initialized
+*/
+typedef struct arena_t {
+    pthread_mutex_t lock;
+    /*
+       Linked list of physical memory chunks, with embedded metadata like
+       the memory blocks.
+    */
+    struct memoryChunk_t* latestPhysicalChunk;
+    blockHeader buckets[FL_INDEX_COUNT][SL_INDEX_COUNT];
+    uint64_t flBitmap;
+    uint32_t slBitmap[FL_INDEX_COUNT];
+    slab* slabs[SLAB_CLASSES];  // heads of the partial slab lists
+    uint64_t now;        // ms, as of the last time someone took the lock
+    uint64_t nextPurge;  // when to look for pages to purge again
+    /*
+       Payloads freed by threads that don't use this arena. They're pushed
+       without taking the lock (linked through their first word), and the
+       next thread to take the lock frees them for real. Only ever popped
+       all at once, so there's no ABA problem.
+    */
+    void* remoteFrees;
+    /*
+       Fast bins: blocks freed lately, by exact payload size, that haven't
+       been coallesced or bucketed yet, because the next malloc of that
+       size would only have to split them back off. They keep their
+       allocated bit, like thread cache blocks, and are linked through
+       their first word. Bin i holds payload size (i+1)*ALIGNMENT.
+    */
+    void* fastBins[FASTBIN_COUNT];
+    size_t fastBytes;    // in all of fastBins
+    size_t chunkSize;    // the least the next chunk will be, see newMemoryChunk
+    // what's left of this arena's part of SCARYMALLOC_RESERVE, if anything
+    char* reserveNext;
+    char* reserveEnd;
+    arenaStats stats;
+} arena;
+
+// how threads get matched up with arenas
+#define ARENA_ROUNDROBIN 0  // each thread picks the next arena once, and keeps it
+#define ARENA_PERCPU 1      // use whatever cpu the thread is running on right now
+
+/*
+   Thread cache. Each thread keeps a small stack of allocated-but-unused
+   blocks for each size up to TCACHE_MAX_SIZE, so most malloc/free pairs
+   never touch the arena or its lock. Blocks in the cache keep their
+   allocated bit set, so nobody coallesces with them. Stacks are linked
+   through the first word of the payload. Bin i holds blocks of payload
+   size (i+1)*ALIGNMENT.
+*/
+typedef struct tcacheBin_t {
+    void* head;
+    unsigned int count;
+} tcacheBin;
+
+#define TCACHE_UNUSED 0   // haven't registered the thread exit hook yet
+#define TCACHE_ACTIVE 1
+#define TCACHE_DEAD 2     // thread is exiting, go straight to the arena
+
+typedef struct threadCache_t {
+    tcacheBin bins[TCACHE_BINS];
+    int state;
+} threadCache;
+
+/*
+   A region (see scarymalloc.h) bumps a pointer through blocks it gets
+   from doMalloc, each starting with one of these. They're linked newest
+   first, so the one being bumped through is always at the front.
+*/
+typedef struct regionBlock_t {
+    struct regionBlock_t* next;
+    size_t size;   // usable bytes after this header
+} regionBlock;
+
+typedef struct scaryRegion_t {
+    regionBlock* blocks;
+    char* next;         // bump pointer into blocks
+    char* end;
+    size_t blockSize;   // how big the next block will be
+} scaryRegion;
 
 /////////////////////////
 // GLOBAL VARS
 /////////////////////////
 
+arena arenas[MAX_ARENAS];
+int numArenas = 0;    // how many of arenas[] are in use. 0 until initArenas
+int arenaPolicy = ARENA_ROUNDROBIN;
+unsigned int nextArena = 0;   // round-robin counter, only touched atomically
+
+pthread_mutex_t initLock = PTHREAD_MUTEX_INITIALIZER;
+int arenasReady = 0;
+
+size_t pageSize = 0x1000;  // the real value comes from sysconf in initArenas
+
+// what chunks get mapped, trimmed and purged in whole units of: a page, or
+// with SCARYMALLOC_THP=1, a huge page, so the kernel can back each one
+// with a single TLB entry and we never break one up again
+int hugePages = 0;
+size_t chunkPage = 0x1000;
+
+// chunk sizes, from SCARYMALLOC_CHUNK_SIZE and SCARYMALLOC_MAX_CHUNK_SIZE
+size_t minChunkSize = MIN_CHUNK_SIZE;
+size_t maxChunkSize = MAX_CHUNK_SIZE;
+
+// size at and above which requests get their own mapping. only the
+// environment (SCARYMALLOC_MMAP_THRESHOLD) can turn off the adjusting
+size_t mmapThreshold = DEFAULT_MMAP_THRESHOLD;
+int mmapThresholdFixed = 0;
+
+// initial-exec, since we're usually LD_PRELOADed and the general-dynamic
+// model can call malloc on first access
+static __thread arena* threadArena __attribute__((tls_model("initial-exec"))) = 0;
+static __thread threadCache tcache __attribute__((tls_model("initial-exec")));
+
+// only used to get a callback when a thread exits, to flush its cache
+pthread_key_t tcacheKey;
+
 /*
-   Linked list of physical memory chunks, with embedded metadata like
-   the memory blocks.
+   The slab region. Reserved once, up front, without committing any
+   memory. Pages are handed out from slabRegionNext; empty slabs that
+   arenas give back go on slabPool for anyone to reuse. slabRegion is
+   0 if slabs are turned off (SCARYMALLOC_SLABS=0) or the reservation failed.
 */
-memoryChunk* latestPhysicalChunk = 0;
+char* slabRegion = 0;
+size_t slabRegionNext = 0;  // only touched atomically
+slab* slabPool = 0;
+pthread_mutex_t slabPoolLock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
-   Buckets are allocated like so: first bucket/freelist is
-   for blocks of payload size 0 to FIRSTBUCKETCEILING. next is
-   from (FBC, 2*FBC], (2*FBC, 4*FBC], etc., except the last one is
-   just whatever won't fit in previous buckets. Just to repeat,
-   use the payload size of the object, not including header/footer
+   Empty slabs whose page has been given back to the kernel. There's no
+   header left to link them through, so they're kept here by index into
+   the region instead. Also under slabPoolLock. It's big, but it's bss,
+   so it costs nothing till it's used.
+*/
+uint32_t cleanSlabs[SLAB_REGION_SIZE/SLAB_SIZE];
+size_t numCleanSlabs = 0;
 
-   Array is of bucket objects so when first object wants to unlink itself
-   it doesn't have to check special case of being at front. 
+// purge schedule. a negative decay means never do that step
+long dirtyDecayMs = DEFAULT_DIRTY_DECAY_MS;
+long muzzyDecayMs = DEFAULT_MUZZY_DECAY_MS;
+uint64_t purgeIntervalMs = 0;  // set in initPurging
+
+/*
+   Process-wide counters for what isn't in any arena. These only change
+   around an mmap or munmap, so atomics are nothing next to the syscall.
+   mappedBytes covers chunks, direct blocks and slab pages; purged pages
+   still count, since the address space is still ours.
+*/
+size_t directBlocks = 0;
+size_t directBytes = 0;
+uint64_t directMaps = 0;
+size_t mappedBytes = 0;
+size_t peakMappedBytes = 0;
+int statsAtExit = 0;   // SCARYMALLOC_STATS: 1 for malloc_stats, 2 for json
+int statsFd = -1;      // stderr, dup'd early, since some programs close it
+char heapMapPrefix[256];   // SCARYMALLOC_HEAP_MAP, or empty
+
+/*
+   Tracing (see scarymalloc.h) is compiled out completely unless
+   SCARY_TRACE is defined, so the TRACE macros are all there is to it in a
+   normal build. Each thread has its own buffer, mmapped the first time it
+   records anything, so there's nothing to lock and nothing to malloc.
+*/
+#ifdef SCARY_TRACE
+typedef struct traceBuffer_t {
+    scaryTraceEvent* events;
+    unsigned int count;
+    uint32_t thread;
+    int newChunk;   // set when this thread mmaps a chunk, for the next event
+} traceBuffer;
 
-   CRITICAL that everything is 0-initialized
+static __thread traceBuffer trace __attribute__((tls_model("initial-exec")));
+int traceFd = -1;   // SCARYMALLOC_TRACE, if it's set
+uint32_t nextTraceThread = 0;
+
+void traceEvent(int op, void* ptr, void* old, size_t size);
+void initTrace(void);
+#define TRACE(op, ptr, old, size) traceEvent(op, ptr, old, size)
+#define TRACE_NEW_CHUNK() (trace.newChunk = 1)
+#else
+#define TRACE(op, ptr, old, size) ((void)0)
+#define TRACE_NEW_CHUNK() ((void)0)
+#endif
+
+/*
+   Heap profiling, with SCARYMALLOC_PROFILE set to a number of bytes. Every
+   thread counts down a random number of bytes allocated, with that mean,
+   and whatever allocation gets it to zero is sampled: its stack goes in
+   this table, and its block gets SAMPLEDBIT so free knows to take it out
+   again. So the table is always a sample of what's live right now, and
+   bigger blocks are more likely to be in it, in proportion to their size.
+   The table is mmapped when profiling starts, and only touched as it's
+   used, so nothing in here ever mallocs.
 */
-blockHeader buckets[NUMBUCKETS] = {{0,0,0,0}};
+typedef struct profileSample_t {
+    struct profileSample_t* next;   // in its bucket, or the free list
+    void* ptr;
+    size_t size;     // as asked for
+    int depth;
+    void* stack[PROFILE_DEPTH];
+} profileSample;
+
+typedef struct profileThread_t {
+    int64_t countdown;  // bytes to go till the next sample
+    uint64_t random;    // xorshift state. 0 until the thread's first countdown
+    int busy;           // in the middle of taking a sample, so don't take another
+} profileThread;
+
+size_t profileRate = 0;    // mean bytes between samples. 0 if profiling is off
+static __thread profileThread profiler __attribute__((tls_model("initial-exec")));
+profileSample* profileTable = 0;
+profileSample* profileBuckets[PROFILE_BUCKETS];
+profileSample* profileFree = 0;  // samples that were used and then let go
+size_t profileUsed = 0;          // how far into profileTable has ever been used
+size_t profileObjects = 0;       // live samples, and their bytes
+size_t profileBytes = 0;
+// a spinlock, so the dump signal can try it. see lockProfile
+int profileLocked = 0;
+int profileDumpPending = 0;
+char profilePrefix[256];          // SCARYMALLOC_PROFILE_FILE, or empty
+unsigned int profileDumps = 0;
 
 
 /////////////////////////
 // FUNCTIONS
 /////////////////////////
 
-size_t mylog2(size_t foo) {
-    int n = 0;
-    for(; foo; n++) {
-        foo = foo >> 1;
-    }
-    return n-1;
+int floorLog2(size_t n) {
+    // n > 0
+    return 63 - __builtin_clzl(n);
+}
+
+size_t next_page_value(size_t n) {
+    // pageSize is a power of two
+    return (n + pageSize - 1) & ~(pageSize - 1);
 }
 
-size_t pow2(size_t foo) {
-    return 1 << foo;
+size_t next_chunk_page_value(size_t n) {
+    return (n + chunkPage - 1) & ~(chunkPage - 1);
 }
 
 size_t next_aligned_value(size_t n) {
@@ -107,134 +496,200 @@ size_t next_aligned_value(size_t n) {
     return n;
 }
 
-int getBucket(size_t s) {
-    // think of this as a hash function
-    assert(s > 0);
-    size_t lastCeiling = FIRSTBUCKETCEILING*pow2(NUMBUCKETS - 2);
-    if(s > lastCeiling) {
-        return NUMBUCKETS-1;
+void getBucket(size_t s, int* fl, int* sl) {
+    // which bucket a free block of size s goes in. think of this as a
+    // hash function
+    if(s < SMALL_BLOCK_SIZE) {
+        *fl = 0;
+        *sl = s / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
+        return;
     }
-    size_t prelog = 2*(s-1)/FIRSTBUCKETCEILING;
-    if(prelog == 0) {
-        return 0;
+    int f = floorLog2(s);
+    if(f >= FL_INDEX_MAX) {
+        *fl = FL_INDEX_COUNT - 1;
+        *sl = SL_INDEX_COUNT - 1;
+        return;
+    }
+    // the bits just under the top one pick the slice
+    *sl = (int)(s >> (f - SL_INDEX_LOG2)) ^ SL_INDEX_COUNT;
+    *fl = f - FL_INDEX_SHIFT + 1;
+}
+
+size_t getBucketFloor(int fl, int sl) {
+    // the smallest size that goes in bucket (fl, sl)
+    if(fl == 0) {
+        return sl*(SMALL_BLOCK_SIZE/SL_INDEX_COUNT);
+    }
+    size_t range = 1ul << (fl + FL_INDEX_SHIFT - 1);
+    return range + sl*(range/SL_INDEX_COUNT);
+}
+
+void getSearchBucket(size_t s, int* fl, int* sl) {
+    // the first bucket where *every* block is at least s. round s up to
+    // the next bucket boundary, unless it's on one already
+    if(s >= SMALL_BLOCK_SIZE) {
+        size_t round = ((size_t)1 << (floorLog2(s) - SL_INDEX_LOG2)) - 1;
+        if(s + round > s) {
+            s += round;
+        }
+    }
+    getBucket(s, fl, sl);
+}
+
+void statMapped(ssize_t bytes) {
+    // something just got mapped (or unmapped, if negative)
+    size_t now = __atomic_add_fetch(&mappedBytes, bytes, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peakMappedBytes, __ATOMIC_RELAXED);
+    while(now > peak && !__atomic_compare_exchange_n(&peakMappedBytes, &peak, now, 1,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        // peak got reloaded, try again
     }
-    return mylog2(prelog);
 }
 
-blockHeader* initNewBlock(void* blockPosition) {
+blockHeader* initNewBlock(void* blockPosition, arena* owner) {
+    // a free block, not linked anywhere. writes into what will be the
+    // payload, so there has to be one
     blockHeader* b = (blockHeader*)blockPosition;
     b->logicalPrev = 0;
     b->logicalNext = 0;
     b->size = 0;
-    b->pad = 0xdeadbeef00c0ffeeul;
-    // caller must set footer, bit flags
+    b->arena = owner;
+    // caller must set size, footer, bit flags
     return b;
 }
 
+void initFence(blockHeader* fence, arena* owner, int prevFree) {
+    // no payload, so none of initNewBlock
+    fence->arena = owner;
+    fence->size = LOWESTBIT | (prevFree ? PREVFREEBIT : 0);
+}
+
 char* getBlockPayload(blockHeader* block) {
-    return (char*)block + sizeof(blockHeader);
+    return (char*)block + BLOCK_OVERHEAD;
+}
+
+blockHeader* getPayloadBlock(void* p) {
+    return (blockHeader*)( (char*)p - BLOCK_OVERHEAD );
+}
+
+blockHeader* getPhysicalNext(blockHeader* block) {
+    // always there for arena blocks, even if it's just the fence
+    return (blockHeader*)( getBlockPayload(block) + MASKED_VALUE(block->size) );
 }
 
 blockFooter* getFooter(blockHeader* block) {
-    // only assumes header size is valid
-    return (blockFooter*)(getBlockPayload(block) + MASKED_VALUE(block->size));
+    // only assumes header size is valid. only means anything if block is free
+    return (blockFooter*)getPhysicalNext(block) - 1;
 }
 
 // accessors for bitfields of blockHeader
-void setHasPhysicalPrev(blockHeader* block, int has){
-    if(has) {
-        block->size = block->size | LOWESTBIT;
-    } else {
-        // unset
-        block->size = block->size & HIGHBITS; // only keep high bits
-    }
-}
-int getHasPhysicalPrev(blockHeader* block) {
+int isAllocated(blockHeader* block) {
     return !!(block->size & LOWESTBIT);
 }
 
-void setHasPhysicalNext(blockHeader* block, int has){
-    blockFooter* foot = getFooter(block);
-    if(has) {
-        foot->size = foot->size | LOWESTBIT;
+int isMmapped(blockHeader* block) {
+    return !!(block->size & MMAPPEDBIT);
+}
+
+int isFence(blockHeader* block) {
+    return !MASKED_VALUE(block->size);
+}
+
+void setPrevFree(blockHeader* block, int prevFree) {
+    if(prevFree) {
+        block->size = block->size | PREVFREEBIT;
     } else {
-        foot->size = foot->size & HIGHBITS;
+        block->size = block->size & ~PREVFREEBIT;
     }
 }
-int getHasPhysicalNext(blockHeader* block) {
-    blockFooter* foot = getFooter(block);
-    return !!(foot->size & LOWESTBIT);
+int getPrevFree(blockHeader* block) {
+    return !!(block->size & PREVFREEBIT);
 }
 
 void setAllocated(blockHeader* block, int allocated) {
+    // also keeps the physically next block's idea of whether we're free
+    // up to date. a block that's just been freed isn't in a bucket, and
+    // needs its footer
     if(allocated) {
-        block->logicalPrev = (blockHeader*)((uintptr_t)block->logicalPrev | LOWESTBIT);
+        block->size = block->size | LOWESTBIT;
     } else {
-        block->logicalPrev = (blockHeader*)((uintptr_t)block->logicalPrev & HIGHBITS);
+        block->size = block->size & ~LOWESTBIT;
+        block->logicalPrev = 0;
+        block->logicalNext = 0;
+        getFooter(block)->size = MASKED_VALUE(block->size);
+    }
+    if(!isMmapped(block)) {
+        setPrevFree(getPhysicalNext(block), !allocated);
     }
-}
-int isAllocated(blockHeader* block) {
-    return !!((uintptr_t)block->logicalPrev & LOWESTBIT);
 }
 
-
 void setBlockSize(blockHeader* block, size_t s) {
-    // in both header and footer.
-    // make darn sure there's room for size_t + sizeof(blockFooter)
-    // bytes after the block header
-    // preserves hasPhysicalPrev bit, does nothing for physNext
-    int hadPhysPrev = getHasPhysicalPrev(block);
-    block->size = s;
-    setHasPhysicalPrev(block, hadPhysPrev);
-    blockFooter* footer = getFooter(block);
-    footer->size = s;
-    // can't assume there was a valid value of footer->size before
-    // probably the footer just got moved anyway
-    // so we don't know how to set hasPhysicalNext in this fn, must be done by caller
+    // in the header, keeping the flags, and in the footer if block is free.
+    // an allocated block's footer would be in the middle of someone's data
+    block->size = s | (block->size & ~HIGHBITS);
+    if(!isAllocated(block)) {
+        getFooter(block)->size = s;
+    }
 }
 
 char* getChunkPayload(memoryChunk* chunk) {
     return (char*)chunk + sizeof(memoryChunk);
 }
 
-
-blockHeader* getPhysicalNext(blockHeader* block) {
-    assert(getHasPhysicalNext(block));
-    return (blockHeader*)( getBlockPayload(block) + MASKED_VALUE(block->size) + sizeof(blockFooter) );
+blockHeader* getChunkFence(memoryChunk* chunk) {
+    return (blockHeader*)(getChunkPayload(chunk) + chunk->size - BLOCK_OVERHEAD);
 }
 
 blockHeader* getPhysicalPrev(blockHeader* block) {
-    assert(getHasPhysicalPrev(block));
-    blockFooter* prevFoot = (blockFooter*)( (char*)block - sizeof(blockFooter) );
-    return (blockHeader*)( (char*)prevFoot - MASKED_VALUE(prevFoot->size) - sizeof(blockHeader) );
+    // only works if it's free, since only free blocks have footers
+    assert(getPrevFree(block));
+    blockFooter* prevFoot = (blockFooter*)block - 1;
+    return (blockHeader*)( (char*)block - prevFoot->size - BLOCK_OVERHEAD );
+}
+
+void statAllocated(blockHeader* block, int count) {
+    // count is 1 when block gets allocated, -1 when it stops being
+    int fl, sl;
+    arenaStats* stats = &block->arena->stats;
+    getBucket(MASKED_VALUE(block->size), &fl, &sl);
+    stats->allocatedBlocks[fl][sl] += count;
+    stats->allocatedBytes[fl][sl] += count*(ssize_t)MASKED_VALUE(block->size);
 }
 
 void logicalUnlinkBlock(blockHeader* block) {
-    // it's okay that this wipes out allocation bit, since this is only
-    // called on unallocated blocks
-    // block could possibly be unlinked already (notably if called
+    // only ever called on unallocated blocks, since the links are in the
+    // payload. block could possibly be unlinked already (notably if called
     // from mergeBack, when merging prev with original), so we
     // need to check whether it's linked by checking logicalPrev
-    if(MASKED_PTR(block->logicalPrev)) {
+    // block->size has to be what it was when it was bucketed, so
+    // unlink *before* resizing a block
+    if(block->logicalPrev) {
         // our next is now their next
-        MASKED_PTR(block->logicalPrev)->logicalNext = block->logicalNext;
+        block->logicalPrev->logicalNext = block->logicalNext;
         if(block->logicalNext) {
             assert(!isAllocated(block->logicalNext));
             // our prev is now their prev
-            // since we're all in the free list, it's ok to blow away the allocation flag
-            block->logicalNext->logicalPrev = MASKED_PTR(block->logicalPrev);
+            block->logicalNext->logicalPrev = block->logicalPrev;
+        } else {
+            // might have been the last one in its bucket
+            int fl, sl;
+            arena* a = block->arena;
+            getBucket(MASKED_VALUE(block->size), &fl, &sl);
+            if(!a->buckets[fl][sl].logicalNext) {
+                a->slBitmap[fl] &= ~(1u << sl);
+                if(!a->slBitmap[fl]) {
+                    a->flBitmap &= ~(1ul << fl);
+                }
+            }
         }
     }
     // should make debugging easier
-    // keep allocation flag, JIC
-    block->logicalPrev = 0; //(blockHeader*)( (uintptr_t)block->logicalPrev & LOWESTBIT );
+    block->logicalPrev = 0;
     block->logicalNext = 0;
 }
 
 void logicalLinkBlock(blockHeader* newPrev, blockHeader* block) {
     // insert block after newPrev. newPrev -> block -> newPrev's old next
-    // this sets isAllocated(block) to false by wiping the bit
-    // but that's okay because a linked block is always unallocated
     block->logicalPrev = newPrev;
     block->logicalNext = newPrev->logicalNext;
     if(block->logicalNext) {
@@ -243,99 +698,167 @@ void logicalLinkBlock(blockHeader* newPrev, blockHeader* block) {
     newPrev->logicalNext = block;
 }
 
-blockHeader* newMemoryChunk(size_t minSize) {
+blockHeader* getTop(arena* a) {
+    // the free block at the very end of a's latest chunk, if the end is
+    // free. it's kept out of the buckets, so what's left of a fresh chunk
+    // after splitting doesn't have to be bucketed and searched for again
+    // every time, and can be carved from the front instead
+    if(!a->latestPhysicalChunk) {
+        return 0;
+    }
+    blockHeader* fence = getChunkFence(a->latestPhysicalChunk);
+    return getPrevFree(fence) ? getPhysicalPrev(fence) : 0;
+}
+
+void mergeBack(blockHeader* block);
+purgeInfo* getPurgeInfo(blockHeader* block);
+void reBucketBlock(blockHeader* block);
+
+void* mapChunk(arena* a, void* hint, size_t size) {
+    // mmap for a chunk, or MAP_FAILED. with huge pages the chunk has to
+    // start on a huge page boundary too, so if the kernel doesn't put it
+    // right where we asked, map a huge page extra and cut it down
+    char* m;
+    if((size_t)(a->reserveEnd - a->reserveNext) >= size) {
+        // the next piece of the reservation, which is always right after
+        // the last one, and already aligned
+        m = mmap(a->reserveNext, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if(m != MAP_FAILED) {
+            a->reserveNext += size;
+            if(hugePages) {
+                madvise(m, size, MADV_HUGEPAGE);
+            }
+            return m;
+        }
+    }
+    m = mmap(hint, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(m == MAP_FAILED || !hugePages) {
+        return m;
+    }
+    if((uintptr_t)m & (chunkPage - 1)) {
+        munmap(m, size);
+        m = mmap(0, size + chunkPage, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(m == MAP_FAILED) {
+            return m;
+        }
+        char* aligned = (char*)next_chunk_page_value((uintptr_t)m);
+        if(aligned > m) {
+            munmap(m, aligned - m);
+        }
+        munmap(aligned + size, m + chunkPage - aligned);
+        m = aligned;
+    }
+    // only a hint. without THP in the kernel this just fails
+    madvise(m, size, MADV_HUGEPAGE);
+    return m;
+}
+
+blockHeader* newMemoryChunk(arena* a, size_t minSize) {
     // return a block with payload size at least minSize
     // returns null if failed to allocate
-    // leave new physical chunk in global list
+    // leave new physical chunk in a's list. caller holds a->lock
     // note that minSize is a payload size.
-    // create new block with sbrk
-    void* chunkStart = 0;    // the return from sbrk
-    // make sure minsize is aligned, and will still be big enough if
-    // the sbrk address has to be re-aligned
-    minSize = next_aligned_value(minSize) + ALIGNMENT;
-    // will need to carve out chunk header and at least one block w/ header and footer
-    minSize += BLOCK_OVERHEAD + CHUNK_OVERHEAD;
+    // create new block with mmap, which is page aligned, so no need to
+    // fix up the alignment of what comes back
+    void* chunkStart = 0;    // the return from mmap
+    if(minSize > SIZE_MAX/2) {
+        // no chunk could be that big, and the size math below would wrap
+        // around to something small
+        return 0;
+    }
+    minSize = next_aligned_value(minSize);
+    if(minSize < MIN_PAYLOAD) {
+        minSize = MIN_PAYLOAD;
+    }
+    // will need to carve out chunk header, a block header, and the fence
+    minSize += 2*BLOCK_OVERHEAD + CHUNK_OVERHEAD;
+    minSize = next_chunk_page_value(minSize);
     size_t allocationSize;   // the actual useful size of allocation
-    // try the largest of MIN_PHYSICAL_BLOCK and minSize
-    if(minSize < MIN_PHYSICAL_BLOCK) {
-        allocationSize = MIN_PHYSICAL_BLOCK;
+    // try the largest of the arena's chunk size and minSize. the chunk size
+    // doubles every time, so a program that keeps growing its heap only
+    // has to come to the kernel a few times, not for every little malloc
+    if(minSize < a->chunkSize) {
+        allocationSize = next_chunk_page_value(a->chunkSize);
     } else {
-        // minSize >= MIN_PHYSICAL_BLOCK
         allocationSize = minSize;
     }
-    chunkStart = sbrk(allocationSize);
-    if(!chunkStart) {
+    // ask for the spot right after our latest chunk, so we can keep
+    // extending it like we could with sbrk. the kernel is free to say no,
+    // and we'll just start a new chunk
+    memoryChunk* latestPhysicalChunk = a->latestPhysicalChunk;
+    void* hint = 0;
+    if(latestPhysicalChunk) {
+        hint = getChunkPayload(latestPhysicalChunk) + latestPhysicalChunk->size;
+    }
+    chunkStart = mapChunk(a, hint, allocationSize);
+    if(chunkStart == MAP_FAILED) {
         // crap, failed to alloc
         if(allocationSize > minSize) {
             // we might be able to salvage by only allocating min size
-            chunkStart = sbrk(minSize);
             allocationSize = minSize;
-            if(!chunkStart) {
-                // that's it
-                return 0;
-            }
-        } else {
+            chunkStart = mapChunk(a, hint, allocationSize);
+        }
+        if(chunkStart == MAP_FAILED) {
             // no recourse, we already tried the smallest possible chunk
             return 0;
         }
-        return 0;
-    };
-    // chunkStart != 0, with length allocationSize
-    // don't assume sbrk is aligned (can move chunkStart up by <= ALIGNMENT - 1,
-    // so that's why we inflate the minSize
-    //printf("sbrk'd %p with size %#lx\n", chunkStart, allocationSize);
-    void* chunkEnd = chunkStart + allocationSize; // this one we'll round down to alignment
-    chunkStart = (void*)next_aligned_value((uintptr_t)chunkStart);
-    chunkEnd = (void*)( ((uintptr_t)chunkEnd)/ALIGNMENT*ALIGNMENT ); // round down to next *lowest* multiple of ALIGNMENT
-    allocationSize = chunkEnd - chunkStart; // real, usable, aligned space
+    }
+    // chunkStart is valid, with length allocationSize
+    if(a->chunkSize < maxChunkSize) {
+        a->chunkSize = a->chunkSize*2 < maxChunkSize ? a->chunkSize*2 : maxChunkSize;
+    }
+    TRACE_NEW_CHUNK();
+    a->stats.chunkMaps++;
+    a->stats.chunkBytes += allocationSize;
+    statMapped(allocationSize);
+    //printf("mmapped %p with size %#lx\n", chunkStart, allocationSize);
+    assert((uintptr_t)chunkStart % ALIGNMENT == 0);
     assert(allocationSize >= minSize);
     assert(allocationSize % ALIGNMENT == 0);
-    // coallesce with previously allocated chunk if possible
+    // coallesce with previously allocated chunk if possible. only our own
+    // latest chunk counts; some other arena's chunk might be right below us
     if(latestPhysicalChunk &&
             (getChunkPayload(latestPhysicalChunk) + latestPhysicalChunk->size) == chunkStart) {
-        // to extend the old block with new data, we'll need to save it
-        // footer is at last ALIGNMENT bytes of latestPhysicalChunk
+        // the old fence becomes the header of a block made of the new
+        // memory, and there's a new fence at the new end
         //printf("  merging with last phys chunk\n");
-        blockFooter* oldFooter = (blockFooter*)( getChunkPayload(latestPhysicalChunk)
-                                                + latestPhysicalChunk->size
-                                                - sizeof(blockFooter) );
-        blockHeader* oldBlock = (blockHeader*)((char*)oldFooter
-                                              - MASKED_VALUE(oldFooter->size)
-                                              - sizeof(blockHeader));
-        // extend the physical chunk
+        blockHeader* oldFence = getChunkFence(latestPhysicalChunk);
+        int lastWasFree = getPrevFree(oldFence);
         latestPhysicalChunk->size += allocationSize; // new memory is pure payload
-        // now extend the block if free, otherwise create a new one
-        if(isAllocated(oldBlock)) {
-            // we need a new block anyway
-            // it does have a physical prev, no physical next
-            blockHeader* newBlock = initNewBlock(chunkStart);
-            // set the footer
-            setBlockSize(newBlock, allocationSize - BLOCK_OVERHEAD);
-            // physical adjacency stuff
-            setHasPhysicalPrev(newBlock, 1);
-            setHasPhysicalNext(newBlock, 0);
-            setHasPhysicalNext(oldBlock, 1); // now it does, anyway
-            // that's all, it's ready to split (but not logically linked)
-            return newBlock;
-        } else {
-            // addition preserves low bits (including phys prev flag)
-            oldBlock->size += allocationSize;
-            getFooter(oldBlock)->size = oldBlock->size;
-            // oldBlock doesn't have physical next, so we're done
-            logicalUnlinkBlock(oldBlock); // caller will bucket what needs bucketing
-            return oldBlock;
+        a->stats.chunkExtends++;
+        blockHeader* newBlock = initNewBlock(oldFence, a);
+        setBlockSize(newBlock, allocationSize - BLOCK_OVERHEAD);
+        getPurgeInfo(newBlock)->zeroFrom = 0;   // all of it, it's brand new
+        initFence(getChunkFence(latestPhysicalChunk), a, 1);
+        if(lastWasFree) {
+            // extend the old last block instead. caller will bucket what
+            // needs bucketing
+            setPrevFree(newBlock, 1);
+            blockHeader* last = getPhysicalPrev(newBlock);
+            logicalUnlinkBlock(last);
+            mergeBack(last);
+            newBlock = last;
         }
+        return newBlock;
     } else {
         // we've got to do it all fresh
         //printf("  making new phys chunk\n");
         memoryChunk* newChunk = (memoryChunk*)chunkStart;
+        blockHeader* oldTop = getTop(a);
         newChunk->older = latestPhysicalChunk;
         newChunk->size = allocationSize - CHUNK_OVERHEAD;
-        latestPhysicalChunk = newChunk;
-        blockHeader* newBlock = initNewBlock(getChunkPayload(newChunk));
-        setBlockSize(newBlock, newChunk->size - BLOCK_OVERHEAD);
-        // new block is not allocated, and has no physical neighbors, so 0 for
-        // flags is correct
+        a->latestPhysicalChunk = newChunk;
+        if(oldTop) {
+            // it isn't the top anymore, so it's a free block like any other
+            reBucketBlock(oldTop);
+        }
+        blockHeader* newBlock = initNewBlock(getChunkPayload(newChunk), a);
+        setBlockSize(newBlock, newChunk->size - 2*BLOCK_OVERHEAD);
+        getPurgeInfo(newBlock)->zeroFrom = 0;
+        initFence(getChunkFence(newChunk), a, 1);
+        // new block is not allocated, and is the first thing in the chunk,
+        // so 0 for its flags is correct
         return newBlock;
     }
 }
@@ -343,179 +866,2812 @@ blockHeader* newMemoryChunk(size_t minSize) {
 void reBucketBlock(blockHeader* block) {
     // must already be unlinked
     // most likely, block has been newly split (or coallesced)
-    int destBucket = getBucket(MASKED_VALUE(block->size));
-    // go through destBucket and find correct location
-    blockHeader* currBlock = &buckets[destBucket];
-    while(currBlock->logicalNext &&
-          (MASKED_VALUE(currBlock->logicalNext->size) < MASKED_VALUE(block->size)) ) {
-        currBlock = currBlock->logicalNext;
-    }
-    // currBlock is non-null by construction
-    // insert as currBlock->logicalNext
-    logicalLinkBlock(currBlock, block);
-
-    // hypothetically nicer algorithm
-    //if(currBucketIndex != destBucket) {
-    //    // unlink it
-    //    // go through destBucket and insert in correct location
-    //} else {
-    //    // in correct bucket
-    //    // move up or down appropriately
-    // might require size of bucket heads to be initialized to floor-1
-    // so size comparisons don't need special cases at ends
+    // goes into the buckets of whichever arena owns it, at the front,
+    // unless it's the top, which just stays unlinked
+    int fl, sl;
+    arena* a = block->arena;
+    if(getPhysicalNext(block) == getChunkFence(a->latestPhysicalChunk)) {
+        return;
+    }
+    getBucket(MASKED_VALUE(block->size), &fl, &sl);
+    logicalLinkBlock(&a->buckets[fl][sl], block);
+    a->slBitmap[fl] |= 1u << sl;
+    a->flBitmap |= 1ul << fl;
 }
 
-void splitBlock(blockHeader* block, size_t s) {
+blockHeader* findFreeBlock(arena* a, size_t s) {
+    // a free block with payload at least s from the buckets, or 0. still linked
+    int fl, sl;
+    // the bucket s itself goes in might well have a block that fits
+    // at the front, which is a better fit than anything further up
+    getBucket(s, &fl, &sl);
+    blockHeader* block = a->buckets[fl][sl].logicalNext;
+    if(block) {
+        a->stats.searchSteps++;
+        if(MASKED_VALUE(block->size) >= s) {
+            return block;
+        }
+    }
+    getSearchBucket(s, &fl, &sl);
+    uint32_t slMap = a->slBitmap[fl] & (~0u << sl);
+    if(!slMap) {
+        // nothing in this first level, go up to the next one with anything
+        uint64_t flMap = (fl + 1 < 64) ? (a->flBitmap & (~0ul << (fl + 1))) : 0;
+        if(!flMap) {
+            return 0;
+        }
+        fl = __builtin_ctzl(flMap);
+        slMap = a->slBitmap[fl];
+    }
+    sl = __builtin_ctz(slMap);
+    block = a->buckets[fl][sl].logicalNext;
+    if(fl == FL_INDEX_COUNT - 1 && sl == SL_INDEX_COUNT - 1) {
+        // the catchall bucket is the one place rounding up doesn't
+        // guarantee a fit
+        while(block && MASKED_VALUE(block->size) < s) {
+            a->stats.searchSteps++;
+            block = block->logicalNext;
+        }
+    }
+    a->stats.searchSteps += block != 0;
+    return block;
+}
+
+purgeInfo* getPurgeInfo(blockHeader* block) {
+    // right after the links. only meaningful for free blocks
+    return (purgeInfo*)(block + 1);
+}
+
+char* getZeroFrom(blockHeader* block) {
+    // start of the zeroes at the end of a free block. everything from here
+    // to the footer is zero, or there are none if it's at or past the
+    // footer. purge info gets copied along when blocks are split, so it can
+    // be from before this block's own purge info
+    char* zeroFrom = getPurgeInfo(block)->zeroFrom;
+    char* start = (char*)(getPurgeInfo(block) + 1);
+    return zeroFrom > start ? zeroFrom : start;
+}
+
+void setNoZeroes(blockHeader* block) {
+    getPurgeInfo(block)->zeroFrom = (char*)UINTPTR_MAX;
+}
+
+blockHeader* carveBlock(blockHeader* block, size_t s) {
+    // cut block down to payload s and make what's left over into a block of
+    // its own right after it. returns the leftover block, not linked
+    // anywhere, or 0 if there wasn't enough left over to bother
     assert(MASKED_VALUE(block->size) >= s);
     assert(s % ALIGNMENT == 0);   // size should already be aligned
+    if(s < MIN_PAYLOAD) {
+        s = MIN_PAYLOAD;   // block has to stay big enough to be freed
+    }
     // after carving out a new payload, there needs to be enough left
-    if(MASKED_VALUE(block->size) <= (s + BLOCK_OVERHEAD)) {
+    if(MASKED_VALUE(block->size) < s + BLOCK_OVERHEAD + MIN_PAYLOAD) {
         // don't even bother
-        return;
+        return 0;
     }
     size_t leftover_bytes = MASKED_VALUE(block->size) - s - BLOCK_OVERHEAD; // amount that would actually be left for payload
-    // leftover_bytes is at least ALIGNMENT, so proceed
-    int hadPhysNext = getHasPhysicalNext(block);
     setBlockSize(block, s);
-    blockHeader* newBlock = initNewBlock(getBlockPayload(block) + s + sizeof(blockFooter));
+    blockHeader* newBlock = initNewBlock(getBlockPayload(block) + s, block->arena);
+    setPrevFree(newBlock, !isAllocated(block));
     setBlockSize(newBlock, leftover_bytes);  // set up the footer
-    // physical adjacency
-    setHasPhysicalNext(block, 1);    // definitely does now
-    setHasPhysicalPrev(newBlock, 1);
-    setHasPhysicalNext(newBlock, hadPhysNext); // pass on original hasPhysNext-ness
-                                               // to latter block
-    reBucketBlock(newBlock);
+    // whatever's after it had block before it, and now has a free block
+    setPrevFree(getPhysicalNext(newBlock), 1);
+    block->arena->stats.splits++;
+    return newBlock;
+}
+
+void splitBlock(blockHeader* block, size_t s) {
+    // block is free and unlinked. the leftovers go back in the buckets
+    purgeInfo info = *getPurgeInfo(block);
+    blockHeader* newBlock = carveBlock(block, s);
+    if(newBlock) {
+        // the leftover pages are in whatever state the whole block's were
+        *getPurgeInfo(newBlock) = info;
+        reBucketBlock(newBlock);
+    }
     // don't rebucket (the original) block, since we're about to fill it
 }
 
-void* malloc(size_t s) {
-    blockHeader* returnedBlock = 0;
-    int i;
-    s = next_aligned_value(s); // we only want to allocate aligned-size blocks, to keep
-                               // all the headers and payloads aligned
-    if(!s) { return 0; }
-    //printf("mallocing %lu bytes\n", s);
-    // this is where you start searching through the freelists
-    int bucket = getBucket(s);
-    for(i=bucket; i<NUMBUCKETS; ++i) {
-        // traverse bucket, looking for blocks with size large enough
-        // all the blocks here are free
-        blockHeader* currBlock = buckets[i].logicalNext; // buckets[i] is an anchor
-        while(currBlock && currBlock->size < s) {
-            currBlock = currBlock->logicalNext;
-        }
-        // if we found a block the right size
-        if(currBlock) {
-            // split, etc
-            // unlink if necessary
-            splitBlock(currBlock, s);
-            logicalUnlinkBlock(currBlock);
-            returnedBlock = currBlock;
-            break;
-        }
+int isSlabPointer(void* p) {
+    // unsigned, so pointers below the region wrap around and fail too
+    return ((uintptr_t)p - (uintptr_t)slabRegion) < SLAB_REGION_SIZE && slabRegion;
+}
+
+slab* getSlab(void* p) {
+    return (slab*)((uintptr_t)p & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+char* getSlabObject(slab* sl, unsigned int i) {
+    return (char*)sl + SLAB_HEADER_SIZE + i*slabClassSize[sl->sizeClass];
+}
+
+void slabUnlink(arena* a, slab* sl) {
+    if(sl->prev) {
+        sl->prev->next = sl->next;
+    } else {
+        a->slabs[sl->sizeClass] = sl->next;
     }
-    if(!returnedBlock) {
-        // no free blocks suitable, must go for new memory
-        blockHeader* newBlock = newMemoryChunk(s);
-        if(!newBlock) {
-            // well, crap then
-            // printf("failed to malloc\n");
-            errno = ENOMEM;
+    if(sl->next) {
+        sl->next->prev = sl->prev;
+    }
+    sl->prev = 0;
+    sl->next = 0;
+}
+
+void slabLink(arena* a, slab* sl) {
+    // onto the front of the partial list
+    sl->prev = 0;
+    sl->next = a->slabs[sl->sizeClass];
+    if(sl->next) {
+        sl->next->prev = sl;
+    }
+    a->slabs[sl->sizeClass] = sl;
+}
+
+slab* newSlab(arena* a, unsigned int sizeClass) {
+    // get an empty page from the pool, or else fresh from the region.
+    // returns 0 when the region is used up
+    slab* sl;
+    pthread_mutex_lock(&slabPoolLock);
+    sl = slabPool;
+    if(sl) {
+        slabPool = sl->next;
+    } else if(numCleanSlabs) {
+        sl = (slab*)(slabRegion + (size_t)cleanSlabs[--numCleanSlabs]*SLAB_SIZE);
+    }
+    pthread_mutex_unlock(&slabPoolLock);
+    if(!sl) {
+        size_t offset = __atomic_fetch_add(&slabRegionNext, SLAB_SIZE, __ATOMIC_RELAXED);
+        if(offset + SLAB_SIZE > SLAB_REGION_SIZE) {
             return 0;
         }
-        // split the block
-        // here the block will not be in a free list yet
-        splitBlock(newBlock, s);
-        // now the leftovers are in free list
-        returnedBlock = newBlock;
+        sl = (slab*)(slabRegion + offset);
+        statMapped(SLAB_SIZE);
     }
-    printf("malloc returning %p for size %lu\n", getBlockPayload(returnedBlock), s);
-    setAllocated(returnedBlock, 1);
-    return getBlockPayload(returnedBlock);
+    a->stats.slabs++;
+    sl->arena = a;
+    sl->freeList = 0;
+    sl->sizeClass = sizeClass;
+    sl->used = 0;
+    sl->bump = 0;
+    sl->capacity = (SLAB_SIZE - SLAB_HEADER_SIZE)/slabClassSize[sizeClass];
+    slabLink(a, sl);
+    return sl;
 }
 
-void mergeBack(blockHeader* block) {
-    // merge with physical next block, if it's free
-    assert(getHasPhysicalNext(block)); // caller should verify this
-    blockHeader* next = getPhysicalNext(block);
-    if(!isAllocated(next)) {
-        logicalUnlinkBlock(next); // may already be unlinked?
-        int finalHasPhysNext = getHasPhysicalNext(next);
-        int finalHasPhysPrev = getHasPhysicalPrev(block);
-        // we've eliminated exactly one BLOCK_OVERHEAD of unused space
-        // block's footer, and next's header. the other pieces we keep.
-        setBlockSize(block, MASKED_VALUE(block->size) + MASKED_VALUE(next->size) + BLOCK_OVERHEAD);
-        setHasPhysicalPrev(block, finalHasPhysPrev);
-        setHasPhysicalNext(block, finalHasPhysNext);
+void* slabMalloc(arena* a, unsigned int sizeClass) {
+    // caller holds a->lock. returns 0 if we're out of slabs
+    void* p;
+    slab* sl = a->slabs[sizeClass];
+    if(!sl) {
+        sl = newSlab(a, sizeClass);
+        if(!sl) {
+            return 0;
+        }
     }
-    // if it's allocated, nothing to do.
-    // note that the link status of block has not changed
-    // best not to have it on a list at all...
+    if(sl->freeList) {
+        p = sl->freeList;
+        sl->freeList = *(void**)p;
+    } else {
+        p = getSlabObject(sl, sl->bump++);
+    }
+    if(++sl->used == sl->capacity) {
+        // full, nothing more to get from it till something's freed
+        slabUnlink(a, sl);
+    }
+    a->stats.slabMallocs++;
+    a->stats.slabObjects[sizeClass]++;
+    return p;
 }
 
-blockHeader* coallesce(blockHeader* block) {
-    // merge with physical next and previous, if they exist
-    // and are unallocated. DO NOT put on free list
-    if(getHasPhysicalNext(block)) {
-        mergeBack(block);
+void slabFree(void* p) {
+    // caller holds the slab's arena's lock
+    slab* sl = getSlab(p);
+    arena* a = sl->arena;
+    *(void**)p = sl->freeList;
+    sl->freeList = p;
+    a->stats.slabFrees++;
+    a->stats.slabObjects[sl->sizeClass]--;
+    if(sl->used-- == sl->capacity) {
+        // was full, so it wasn't on the partial list
+        slabLink(a, sl);
     }
-    if(getHasPhysicalPrev(block)) {
-        blockHeader* prev = getPhysicalPrev(block);
-        // note that this requires the allocation bit of the original block to be unset
-        if(!isAllocated(prev)) {
-            logicalUnlinkBlock(prev);
-            mergeBack(prev);
-            block = prev;
-        }
+    if(!sl->used && (sl->prev || sl->next)) {
+        // empty, and the arena has other slabs of this class to use
+        // first, so give it up
+        slabUnlink(a, sl);
+        a->stats.slabs--;
+        sl->freedAt = a->now;
+        pthread_mutex_lock(&slabPoolLock);
+        sl->next = slabPool;
+        slabPool = sl;
+        pthread_mutex_unlock(&slabPoolLock);
     }
-    return block;
 }
 
-void free(void* p) {
-    if(!p) {
+void initSlabs(void) {
+    const char* env = getenv("SCARYMALLOC_SLABS");
+    if(env && !strcmp(env, "0")) {
         return;
     }
-    printf("freeing %p\n", p);
-    blockHeader* block = (blockHeader*)( (char*)p - sizeof(blockHeader) );
-    setAllocated(block, 0);
-    block = coallesce(block);
-    reBucketBlock(block);
+    // MAP_NORESERVE so this costs nothing until pages are touched
+    void* region = mmap(0, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(region != MAP_FAILED) {
+        slabRegion = region;
+    }
 }
 
-void* calloc(size_t nmemb, size_t size) {
-    if(nmemb == 0 || size == 0) {
-        return NULL;
+uint64_t nowMs(void) {
+    // coarse is plenty, and it's a lot cheaper
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+size_t purgeBlock(blockHeader* block, uint64_t now, int force) {
+    // move a free block along dirty -> muzzy -> clean if it's been in its
+    // current state long enough (or right away, if force).
+    // returns how many bytes were given back. with huge pages, only whole
+    // huge pages go, since giving back part of one splits it up for good
+    purgeInfo* info = getPurgeInfo(block);
+    char* start = (char*)next_chunk_page_value((uintptr_t)(info + 1));
+    char* end = (char*)((uintptr_t)getFooter(block) & ~(chunkPage - 1));
+    if(end <= start || info->state == PURGE_CLEAN) {
+        return 0;
     }
-    void* ret = malloc(nmemb*size);
-    if(!ret) { return NULL; }
-    memset(ret, 0, nmemb*size);
-    return ret;
+    if(!force) {
+        long decay = (info->state == PURGE_DIRTY) ? dirtyDecayMs : muzzyDecayMs;
+        if(decay < 0 || now - info->stamp < (uint64_t)decay) {
+            return 0;
+        }
+    }
+    info->stamp = now;
+    if(info->state == PURGE_DIRTY && !force && muzzyDecayMs != 0
+            && !madvise(start, end - start, MADV_FREE)) {
+        info->state = PURGE_MUZZY;
+    } else {
+        // MADV_FREE isn't supported everywhere, and it isn't a real
+        // guarantee anyway, so trimming skips right to this
+        madvise(start, end - start, MADV_DONTNEED);
+        info->state = PURGE_CLEAN;
+        // the purged pages read back as zeroes now. clear the bit after
+        // them too, so it's all one run up to the footer, unless that bit
+        // is most of a huge page
+        char* footer = (char*)getFooter(block);
+        if(getZeroFrom(block) > start && (getZeroFrom(block) <= end || footer - end <= (ssize_t)pageSize)) {
+            if(getZeroFrom(block) > end) {
+                memset(end, 0, footer - end);
+            }
+            info->zeroFrom = start;
+        }
+    }
+    return end - start;
 }
 
-void* realloc(void* ptr, size_t newsize) {
-    // just re-allocate it, don't try anything clever
-    void* newmem = malloc(newsize);
-    if(!newmem) { return 0; }
-    blockHeader* oldBlock = (blockHeader*)((char*)ptr - sizeof(blockHeader));
-    memcpy(newmem, ptr, MASKED_VALUE(oldBlock->size)); // nbd if size is a bit larger than original request
-    free(ptr);
-    return newmem;
+size_t purgeArena(arena* a, int force) {
+    // caller holds a->lock. only blocks of at least a page can possibly
+    // have a whole page to purge (a huge one, with huge pages)
+    int fl, sl;
+    int firstFl, firstSl;
+    size_t purged = 0;
+    getBucket(chunkPage, &firstFl, &firstSl);
+    for(fl=firstFl; fl<FL_INDEX_COUNT; ++fl) {
+        if(!(a->flBitmap & (1ul << fl))) {
+            continue;
+        }
+        for(sl=(fl == firstFl ? firstSl : 0); sl<SL_INDEX_COUNT; ++sl) {
+            blockHeader* block = a->buckets[fl][sl].logicalNext;
+            for(; block; block = block->logicalNext) {
+                purged += purgeBlock(block, a->now, force);
+            }
+        }
+    }
+    if(getTop(a)) {
+        purged += purgeBlock(getTop(a), a->now, force);
+    }
+    return purged;
 }
 
-#ifdef TESTIT
+size_t purgeSlabPool(uint64_t now, int force) {
+    // empty slabs go straight from dirty to clean; there's no footer or
+    // anything to keep, so the whole page goes
+    size_t purged = 0;
+    pthread_mutex_lock(&slabPoolLock);
+    slab** link = &slabPool;
+    while(*link) {
+        slab* sl = *link;
+        if(force || (dirtyDecayMs >= 0 && now - sl->freedAt >= (uint64_t)dirtyDecayMs)) {
+            *link = sl->next;
+            cleanSlabs[numCleanSlabs++] = ((char*)sl - slabRegion)/SLAB_SIZE;
+            madvise(sl, SLAB_SIZE, MADV_DONTNEED);
+            purged += SLAB_SIZE;
+        } else {
+            link = &sl->next;
+        }
+    }
+    pthread_mutex_unlock(&slabPoolLock);
+    return purged;
+}
 
-#include <stdio.h>
+void maybePurge(arena* a) {
+    // caller holds a->lock. cheap unless it's actually time to purge
+    a->now = nowMs();
+    if(a->now < a->nextPurge) {
+        return;
+    }
+    a->nextPurge = a->now + purgeIntervalMs;
+    purgeArena(a, 0);
+    if(a == &arenas[0]) {
+        // somebody has to look after the shared slab pool
+        purgeSlabPool(a->now, 0);
+    }
+}
 
-int main() {
-    // make sure the compiler isn't doing any weird padding
-    // and everything will align right
-    assert(sizeof(blockHeader) == (2*sizeof(void*) + 2*sizeof(size_t)));
-    assert(sizeof(blockFooter) == (2*sizeof(size_t)));
-    assert(sizeof(blockHeader) % ALIGNMENT == 0);
-    assert(sizeof(blockFooter) % ALIGNMENT == 0);
-    assert(BLOCK_OVERHEAD % ALIGNMENT == 0);
-    assert(sizeof(memoryChunk) == (sizeof(size_t) + sizeof(memoryChunk*)));
-    assert(sizeof(memoryChunk) % ALIGNMENT == 0);
+void unmapChunkMemory(arena* a, char* start, size_t size) {
+    // give part of a chunk back to the kernel. if it came off the end of
+    // the reservation, it goes back on, so it's there for the next chunk
+    if(start + size == a->reserveNext) {
+        mmap(start, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        a->reserveNext = start;
+    } else {
+        munmap(start, size);
+    }
+}
+
+size_t trimArena(arena* a, size_t pad) {
+    // give back the free space at the end of the arena's latest chunk,
+    // keeping pad bytes of it, and whole chunks if they're entirely free.
+    // caller holds a->lock
+    size_t trimmed = 0;
+    while(a->latestPhysicalChunk) {
+        memoryChunk* chunk = a->latestPhysicalChunk;
+        char* chunkEnd = getChunkPayload(chunk) + chunk->size;
+        blockHeader* fence = getChunkFence(chunk);
+        if(!getPrevFree(fence)) {
+            break;
+        }
+        blockHeader* last = getPhysicalPrev(fence);
+        if((char*)last == getChunkPayload(chunk) && pad == 0) {
+            // the whole chunk is one free block
+            size_t mapSize = chunk->size + CHUNK_OVERHEAD;
+            logicalUnlinkBlock(last);
+            a->latestPhysicalChunk = chunk->older;
+            trimmed += mapSize;
+            unmapChunkMemory(a, (char*)chunk, mapSize);
+            a->stats.chunkBytes -= mapSize;
+            statMapped(-(ssize_t)mapSize);
+            continue;
+        }
+        // keep the header, the links, the purge info, pad bytes, the
+        // footer, and a fence. the chunk has to keep ending on a huge page
+        // boundary if it's made of them
+        char* keepEnd = (char*)next_chunk_page_value((uintptr_t)(getBlockPayload(last)
+                                                     + MIN_PAYLOAD + pad + BLOCK_OVERHEAD));
+        if(keepEnd < chunkEnd) {
+            logicalUnlinkBlock(last);
+            setBlockSize(last, keepEnd - BLOCK_OVERHEAD - getBlockPayload(last));
+            initFence(getPhysicalNext(last), a, 1);
+            reBucketBlock(last);
+            chunk->size -= chunkEnd - keepEnd;
+            trimmed += chunkEnd - keepEnd;
+            unmapChunkMemory(a, keepEnd, chunkEnd - keepEnd);
+            a->stats.chunkBytes -= chunkEnd - keepEnd;
+            statMapped(-(chunkEnd - keepEnd));
+        }
+        break;
+    }
+    if(getTop(a)) {
+        // if a whole chunk went, the end of the one before it is the top
+        // now, so it can't be in a bucket anymore
+        logicalUnlinkBlock(getTop(a));
+    }
+    return trimmed;
+}
+
+void* backgroundPurge(void* unused) {
+    // optional (SCARYMALLOC_BACKGROUND_PURGE=1) thread that purges on a
+    // timer, so idle arenas get purged too
+    (void)unused;
+    int i;
+    struct timespec interval;
+    interval.tv_sec = purgeIntervalMs/1000;
+    interval.tv_nsec = (purgeIntervalMs%1000)*1000000;
+    if(!purgeIntervalMs) {
+        interval.tv_nsec = 1000000;
+    }
+    for(;;) {
+        nanosleep(&interval, 0);
+        for(i=0; i<numArenas; ++i) {
+            pthread_mutex_lock(&arenas[i].lock);
+            arenas[i].now = nowMs();
+            purgeArena(&arenas[i], 0);
+            pthread_mutex_unlock(&arenas[i].lock);
+        }
+        purgeSlabPool(nowMs(), 0);
+    }
+    return 0;
+}
+
+void initPurging(void) {
+    const char* env = getenv("SCARYMALLOC_DIRTY_DECAY_MS");
+    if(env) {
+        dirtyDecayMs = strtol(env, 0, 0);
+    }
+    env = getenv("SCARYMALLOC_MUZZY_DECAY_MS");
+    if(env) {
+        muzzyDecayMs = strtol(env, 0, 0);
+    }
+    // look a few times per decay period, so nothing sits around for much
+    // longer than it should
+    long shortest = dirtyDecayMs;
+    if(shortest < 0 || (muzzyDecayMs >= 0 && muzzyDecayMs < shortest)) {
+        shortest = muzzyDecayMs;
+    }
+    if(shortest < 0) {
+        purgeIntervalMs = UINT64_MAX/2;   // never, really
+    } else {
+        purgeIntervalMs = shortest/4;
+    }
+}
+
+void lockProfile(void);
+
+void forkPrepare(void) {
+    // don't let fork snapshot an arena halfway through an update
+    int i;
+    for(i=0; i<numArenas; ++i) {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+    pthread_mutex_lock(&slabPoolLock);
+    lockProfile();
+}
+
+void forkParent(void) {
+    int i;
+    __atomic_store_n(&profileLocked, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&slabPoolLock);
+    for(i=numArenas-1; i>=0; --i) {
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+}
+
+void forkChild(void) {
+    // only the forking thread exists in the child, so just start the locks over
+    int i;
+    profileLocked = 0;
+    pthread_mutex_init(&slabPoolLock, 0);
+    for(i=0; i<numArenas; ++i) {
+        pthread_mutex_init(&arenas[i].lock, 0);
+    }
+#ifdef SCARY_TRACE
+    // the parent's events aren't ours to write, and the file is theirs
+    trace.count = 0;
+    traceFd = -1;
+#endif
+}
+
+void tcacheThreadExit(void* unused);
+void initProfiling(void);
+
+void reserveArenas(int n, size_t total) {
+    // SCARYMALLOC_RESERVE: set aside total bytes of address space up front,
+    // split evenly between the arenas, for their chunks to be mapped into
+    // one after another. nothing's committed until a chunk is mapped
+    size_t each = total/n & ~(chunkPage - 1);
+    if(!each) {
+        return;
+    }
+    char* m = mmap(0, each*n + chunkPage, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(m == MAP_FAILED) {
+        return;
+    }
+    // the extra chunkPage is so the whole thing can start on a boundary
+    char* start = (char*)next_chunk_page_value((uintptr_t)m);
+    if(start > m) {
+        munmap(m, start - m);
+    }
+    munmap(start + each*n, m + chunkPage - start);
+    int i;
+    for(i=0; i<n; ++i) {
+        arenas[i].reserveNext = start + i*each;
+        arenas[i].reserveEnd = start + (i + 1)*each;
+    }
+}
+
+void initArenas(void) {
+    // figure out how many arenas to use and how to hand them out.
+    // SCARYMALLOC_ARENAS overrides the count (default: one per cpu),
+    // SCARYMALLOC_ARENA_POLICY=cpu picks by current cpu instead of round-robin
+    int i;
+    pthread_mutex_lock(&initLock);
+    if(arenasReady) {
+        pthread_mutex_unlock(&initLock);
+        return;
+    }
+    int n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char* env = getenv("SCARYMALLOC_ARENAS");
+    if(env && atoi(env) > 0) {
+        n = atoi(env);
+    }
+    if(n < 1) { n = 1; }
+    if(n > MAX_ARENAS) { n = MAX_ARENAS; }
+    env = getenv("SCARYMALLOC_ARENA_POLICY");
+    if(env && !strcmp(env, "cpu")) {
+        arenaPolicy = ARENA_PERCPU;
+    }
+    pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    chunkPage = pageSize;
+    env = getenv("SCARYMALLOC_THP");
+    if(env && !strcmp(env, "1")) {
+        hugePages = 1;
+        chunkPage = HUGE_PAGE_SIZE;
+    }
+    env = getenv("SCARYMALLOC_MMAP_THRESHOLD");
+    if(env) {
+        mmapThreshold = (size_t)strtoul(env, 0, 0);
+        mmapThresholdFixed = 1;
+    }
+    env = getenv("SCARYMALLOC_CHUNK_SIZE");
+    if(env && strtoul(env, 0, 0) > 0) {
+        minChunkSize = (size_t)strtoul(env, 0, 0);
+    }
+    env = getenv("SCARYMALLOC_MAX_CHUNK_SIZE");
+    if(env && strtoul(env, 0, 0) > 0) {
+        maxChunkSize = (size_t)strtoul(env, 0, 0);
+    }
+    if(maxChunkSize < minChunkSize) {
+        maxChunkSize = minChunkSize;
+    }
+    for(i=0; i<n; ++i) {
+        pthread_mutex_init(&arenas[i].lock, 0);
+        arenas[i].chunkSize = minChunkSize;
+    }
+    env = getenv("SCARYMALLOC_RESERVE");
+    if(env) {
+        reserveArenas(n, (size_t)strtoul(env, 0, 0));
+    }
+    pthread_key_create(&tcacheKey, tcacheThreadExit);
+    initSlabs();
+    initPurging();
+#ifdef SCARY_TRACE
+    initTrace();
+#endif
+    numArenas = n;
+    __atomic_store_n(&arenasReady, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&initLock);
+    // these may well call malloc, so only do them once everything is usable
+    pthread_atfork(forkPrepare, forkParent, forkChild);
+    env = getenv("SCARYMALLOC_STATS");
+    if(env && (!strcmp(env, "1") || !strcmp(env, "text"))) {
+        statsAtExit = 1;
+    } else if(env && !strcmp(env, "json")) {
+        statsAtExit = 2;
+    }
+    if(statsAtExit) {
+        statsFd = fcntl(2, F_DUPFD_CLOEXEC, 3);
+    }
+    env = getenv("SCARYMALLOC_HEAP_MAP");
+    if(env) {
+        strncpy(heapMapPrefix, env, sizeof(heapMapPrefix) - 1);
+    }
+    initProfiling();
+    env = getenv("SCARYMALLOC_BACKGROUND_PURGE");
+    if(env && !strcmp(env, "1")) {
+        pthread_t thread;
+        if(!pthread_create(&thread, 0, backgroundPurge, 0)) {
+            pthread_detach(thread);
+        }
+    }
+}
+
+arena* getThreadArena(void) {
+    if(!__atomic_load_n(&arenasReady, __ATOMIC_ACQUIRE)) {
+        initArenas();
+    }
+    if(arenaPolicy == ARENA_PERCPU) {
+        int cpu = sched_getcpu();
+        if(cpu >= 0) {
+            return &arenas[cpu % numArenas];
+        }
+        // no cpu info, fall through to round-robin
+    }
+    if(!threadArena) {
+        unsigned int n = __atomic_fetch_add(&nextArena, 1, __ATOMIC_RELAXED);
+        threadArena = &arenas[n % numArenas];
+    }
+    return threadArena;
+}
+
+void consolidateFastBins(arena* a);
+
+blockHeader* takeFreeBlock(arena* a, size_t s) {
+    // an unlinked free block with payload at least s: the best fit in the
+    // buckets, or else the top. if neither will do, whatever's in the fast
+    // bins gets coallesced in case that makes one, and after that it's a
+    // new chunk, which extends the top if the kernel lets it. returns 0 if
+    // out of memory. caller holds a->lock
+    blockHeader* block = findFreeBlock(a, s);
+    if(block) {
+        logicalUnlinkBlock(block);
+        return block;
+    }
+    block = getTop(a);
+    if(block && MASKED_VALUE(block->size) >= s) {
+        return block;
+    }
+    if(a->fastBytes) {
+        consolidateFastBins(a);
+        return takeFreeBlock(a, s);
+    }
+    return newMemoryChunk(a, s);
+}
+
+blockHeader* blockMalloc(arena* a, size_t s) {
+    // carve an allocated block with payload at least s out of a.
+    // s must be aligned and nonzero. caller holds a->lock
+    if(s <= FASTBIN_MAX_SIZE) {
+        size_t exact = s < MIN_PAYLOAD ? MIN_PAYLOAD : s;
+        void** bin = &a->fastBins[exact/ALIGNMENT - 1];
+        if(*bin) {
+            // exactly the right size, and still marked allocated
+            blockHeader* block = getPayloadBlock(*bin);
+            *bin = *(void**)*bin;
+            a->fastBytes -= exact;
+            setNoZeroes(block);   // doCalloc looks
+            statAllocated(block, 1);
+            a->stats.blockMallocs++;
+            return block;
+        }
+    }
+    blockHeader* returnedBlock = takeFreeBlock(a, s);
+    if(!returnedBlock) {
+        // well, crap then
+        return 0;
+    }
+    // the leftovers go back in the buckets, or stay the top
+    splitBlock(returnedBlock, s);
+    setAllocated(returnedBlock, 1);
+    statAllocated(returnedBlock, 1);
+    a->stats.blockMallocs++;
+    return returnedBlock;
+}
+
+blockHeader* blockMallocAligned(arena* a, size_t align, size_t s) {
+    // like blockMalloc, but the payload is on an align boundary. align is a
+    // power of two bigger than ALIGNMENT. caller holds a->lock
+    // worst case, the boundary is align - ALIGNMENT past the payload, plus
+    // room for a free block in front of it with at least MIN_PAYLOAD
+    if(s < MIN_PAYLOAD) {
+        s = MIN_PAYLOAD;
+    }
+    size_t need = s + align + BLOCK_OVERHEAD + MIN_PAYLOAD;
+    blockHeader* block = takeFreeBlock(a, need);
+    if(!block) {
+        return 0;
+    }
+    purgeInfo info = *getPurgeInfo(block);
+    char* payload = getBlockPayload(block);
+    if((uintptr_t)payload & (align - 1)) {
+        // split off a free block in front, so the next payload is aligned
+        char* aligned = (char*)(((uintptr_t)payload + BLOCK_OVERHEAD + MIN_PAYLOAD + align - 1)
+                                & ~(uintptr_t)(align - 1));
+        blockHeader* front = block;
+        block = carveBlock(front, aligned - payload - BLOCK_OVERHEAD);
+        assert(getBlockPayload(block) == aligned);
+        // front's purge info is still right where it was
+        reBucketBlock(front);
+        // and block is made of the rest of what front was
+        *getPurgeInfo(block) = info;
+    }
+    splitBlock(block, s);
+    setAllocated(block, 1);
+    statAllocated(block, 1);
+    a->stats.blockMallocs++;
+    return block;
+}
+
+size_t blockMallocBatch(arena* a, size_t s, size_t n, void** ptrs) {
+    // n allocated blocks with payload s, carved one after the other out of
+    // a single free block, so it's one search and one rebucketing for the
+    // lot. returns how many it got: n, or 0 if there was no free block big
+    // enough and no memory for one. caller holds a->lock
+    if(s < MIN_PAYLOAD) {
+        s = MIN_PAYLOAD;
+    }
+    size_t need;
+    if(!n || __builtin_mul_overflow(n, s + BLOCK_OVERHEAD, &need)) {
+        return 0;
+    }
+    need -= BLOCK_OVERHEAD;   // the first block's header is already there
+    blockHeader* block = takeFreeBlock(a, need);
+    if(!block) {
+        return 0;
+    }
+    purgeInfo info = *getPurgeInfo(block);
+    size_t i;
+    // there's always room to carve all but the last one, which gets
+    // whatever's left if that's too small to be a block of its own
+    for(i=0; i<n; ++i) {
+        blockHeader* rest = carveBlock(block, s);
+        setAllocated(block, 1);
+        statAllocated(block, 1);
+        a->stats.blockMallocs++;
+        ptrs[i] = getBlockPayload(block);
+        block = rest;
+    }
+    if(block) {
+        *getPurgeInfo(block) = info;
+        reBucketBlock(block);
+    }
+    return n;
+}
+
+void mergeBack(blockHeader* block) {
+    // merge with physical next block, if it's free. the fence at the end
+    // of the chunk looks allocated, so that's never merged
+    blockHeader* next = getPhysicalNext(block);
+    if(!isAllocated(next)) {
+        logicalUnlinkBlock(next); // may already be unlinked?
+        // the zeroes at the end of next end up at the end of block. if
+        // next is nothing but zeroes, it's worth clearing its header and
+        // block's footer to keep block's zeroes too. an allocated block's
+        // purge info is just somebody's data, so leave that alone
+        char* gap = (char*)getFooter(block);
+        char* zeroFrom = getZeroFrom(next);
+        int keepOurs = !isAllocated(block) && zeroFrom == (char*)(getPurgeInfo(next) + 1)
+                       && getZeroFrom(block) < gap;
+        // we've eliminated exactly one BLOCK_OVERHEAD of unused space:
+        // next's header. setBlockSize keeps block's flags
+        setBlockSize(block, MASKED_VALUE(block->size) + MASKED_VALUE(next->size) + BLOCK_OVERHEAD);
+        // what was after next is after block now
+        setPrevFree(getPhysicalNext(block), !isAllocated(block));
+        if(keepOurs) {
+            memset(gap, 0, zeroFrom - gap);
+        } else if(!isAllocated(block)) {
+            getPurgeInfo(block)->zeroFrom = zeroFrom;
+        }
+        block->arena->stats.coallesces++;
+    }
+    // if it's allocated, nothing to do.
+    // note that the link status of block has not changed
+    // best not to have it on a list at all...
+}
+
+blockHeader* coallesce(blockHeader* block) {
+    // merge with physical next and previous, if they exist
+    // and are unallocated. DO NOT put on free list
+    mergeBack(block);
+    if(getPrevFree(block)) {
+        blockHeader* prev = getPhysicalPrev(block);
+        // note that this requires the allocation bit of the original block to be unset
+        logicalUnlinkBlock(prev);
+        mergeBack(prev);
+        block = prev;
+    }
+    return block;
+}
+
+void releaseBlock(blockHeader* block) {
+    // put a block that's allocated, but not counted as such, back in the
+    // buckets. caller holds block->arena->lock
+    setAllocated(block, 0);
+    setNoZeroes(block);   // it's full of whatever the program left there
+    block = coallesce(block);
+    // whatever was merged, the pages are dirty now
+    purgeInfo* info = getPurgeInfo(block);
+    info->state = PURGE_DIRTY;
+    info->stamp = block->arena->now;
+    reBucketBlock(block);
+}
+
+void consolidateFastBins(arena* a) {
+    // really free everything in the fast bins. caller holds a->lock
+    int i;
+    for(i=0; i<FASTBIN_COUNT; ++i) {
+        void* p = a->fastBins[i];
+        a->fastBins[i] = 0;
+        while(p) {
+            void* next = *(void**)p;
+            releaseBlock(getPayloadBlock(p));
+            p = next;
+        }
+    }
+    a->fastBytes = 0;
+}
+
+void blockFree(blockHeader* block) {
+    // give an allocated block back to its arena. caller holds block->arena->lock
+    arena* a = block->arena;
+    size_t s = MASKED_VALUE(block->size);
+    statAllocated(block, -1);
+    a->stats.blockFrees++;
+    if(s <= FASTBIN_MAX_SIZE) {
+        void** p = (void**)getBlockPayload(block);
+        *p = a->fastBins[s/ALIGNMENT - 1];
+        a->fastBins[s/ALIGNMENT - 1] = p;
+        a->fastBytes += s;
+        if(a->fastBytes > FASTBIN_MAX_BYTES) {
+            // enough sitting around that it's probably fragmenting things
+            consolidateFastBins(a);
+        }
+        return;
+    }
+    releaseBlock(block);
+}
+
+void blockFreeRun(blockHeader* block, blockHeader* last) {
+    // give back allocated blocks that sit right next to each other, from
+    // block through last, as one free block. caller holds block->arena->lock
+    blockHeader* b = block;
+    for(;;) {
+        statAllocated(b, -1);
+        block->arena->stats.blockFrees++;
+        if(b == last) {
+            break;
+        }
+        block->arena->stats.coallesces++;
+        b = getPhysicalNext(b);
+    }
+    // block swallows the rest. it's still allocated, so no footer yet
+    setBlockSize(block, (char*)getPhysicalNext(last) - getBlockPayload(block));
+    releaseBlock(block);
+}
+
+void shrinkBlock(blockHeader* block, size_t s) {
+    // hand everything past the first s bytes of an allocated block back to
+    // its arena. caller holds block->arena->lock
+    statAllocated(block, -1);
+    blockHeader* tail = carveBlock(block, s);   // never below MIN_PAYLOAD
+    statAllocated(block, 1);
+    if(tail) {
+        // merges with the next block if that's free
+        releaseBlock(tail);
+    }
+}
+
+int growBlock(blockHeader* block, size_t s) {
+    // try to make an allocated block's payload at least s without moving
+    // it, by taking over the free block after it, and if that's the end of
+    // the arena's latest chunk, new memory after that. returns 1 if it
+    // worked. caller holds block->arena->lock
+    arena* a = block->arena;
+    blockHeader* last = block;    // last block we'd be taking over
+    size_t room = MASKED_VALUE(block->size);
+    blockHeader* next = getPhysicalNext(block);
+    if(!isAllocated(next)) {
+        room += MASKED_VALUE(next->size) + BLOCK_OVERHEAD;
+        last = next;
+    } else if(!isFence(next)) {
+        return 0;
+    }
+    if(room < s) {
+        // newMemoryChunk only extends the latest chunk, so we have to be
+        // right at the end of it
+        memoryChunk* chunk = a->latestPhysicalChunk;
+        if(getPhysicalNext(last) != getChunkFence(chunk)) {
+            return 0;
+        }
+        blockHeader* more = newMemoryChunk(a, s - room);
+        if(!more) {
+            return 0;
+        }
+        if(a->latestPhysicalChunk != chunk) {
+            // the kernel put it somewhere else. keep it for later
+            reBucketBlock(more);
+            return 0;
+        }
+        // more is either last, extended, or a new free block after block
+        next = more;
+    }
+    purgeInfo info = *getPurgeInfo(next);
+    statAllocated(block, -1);
+    mergeBack(block);
+    // give back what we didn't need. it's what's left of next, so its
+    // pages are in whatever state next's were
+    blockHeader* tail = carveBlock(block, s);
+    if(tail) {
+        *getPurgeInfo(tail) = info;
+        reBucketBlock(tail);
+    }
+    statAllocated(block, 1);
+    return 1;
+}
+
+void statDirect(ssize_t blocks, ssize_t bytes) {
+    __atomic_add_fetch(&directBlocks, blocks, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&directBytes, bytes, __ATOMIC_RELAXED);
+    if(blocks > 0) {
+        __atomic_add_fetch(&directMaps, 1, __ATOMIC_RELAXED);
+    }
+    statMapped(bytes);
+}
+
+void* directMalloc(size_t s) {
+    // a block in its own mapping. no arena, no lock, no neighbors
+    size_t mapSize = next_page_value(s + BLOCK_OVERHEAD);
+    if(mapSize < s) {
+        return 0;   // overflowed
+    }
+    void* m = mmap(0, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(m == MAP_FAILED) {
+        return 0;
+    }
+    if(hugePages && mapSize >= HUGE_PAGE_SIZE) {
+        // whatever huge pages fit inside it, anyway
+        madvise(m, mapSize, MADV_HUGEPAGE);
+    }
+    blockHeader* block = initNewBlock(m, 0);
+    block->size = (mapSize - BLOCK_OVERHEAD) | MMAPPEDBIT;
+    setAllocated(block, 1);
+    statDirect(1, mapSize);
+    return getBlockPayload(block);
+}
+
+char* getMappingStart(blockHeader* block) {
+    // where a direct block's mapping starts
+    return (char*)block - block->mapOffset;
+}
+
+void* directAlignedMalloc(size_t align, size_t s) {
+    // like directMalloc, but with the payload on an align boundary. align
+    // is a power of two bigger than ALIGNMENT. map enough to find such a
+    // boundary, then give back whole pages on either side of the block
+    size_t mapSize = next_page_value(s + BLOCK_OVERHEAD + align);
+    char* m = mmap(0, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(m == MAP_FAILED) {
+        return 0;
+    }
+    char* payload = (char*)(((uintptr_t)m + BLOCK_OVERHEAD + align - 1) & ~(uintptr_t)(align - 1));
+    char* start = (char*)((uintptr_t)(payload - BLOCK_OVERHEAD) & ~(uintptr_t)(pageSize - 1));
+    char* end = (char*)next_page_value((uintptr_t)(payload + s));
+    if(start > m) {
+        munmap(m, start - m);
+    }
+    if(end < m + mapSize) {
+        munmap(end, m + mapSize - end);
+    }
+    blockHeader* block = initNewBlock(payload - BLOCK_OVERHEAD, 0);
+    block->mapOffset = (char*)block - start;
+    block->size = (end - payload) | MMAPPEDBIT;
+    setAllocated(block, 1);
+    statDirect(1, end - start);
+    return payload;
+}
+
+void directFree(blockHeader* block) {
+    char* start = getMappingStart(block);
+    size_t mapSize = getBlockPayload(block) + MASKED_VALUE(block->size) - start;
+    if(!mmapThresholdFixed && mapSize > mmapThreshold && mapSize <= MAX_MMAP_THRESHOLD) {
+        // this size is evidently something the program frees again, so
+        // blocks like it are better off reused from the arenas than
+        // mapped and unmapped every time
+        __atomic_store_n(&mmapThreshold, mapSize, __ATOMIC_RELAXED);
+    }
+    munmap(start, mapSize);
+    statDirect(-1, -(ssize_t)mapSize);
+}
+
+void* directRealloc(blockHeader* block, size_t s) {
+    // let the kernel move the pages, rather than copying them. the block
+    // stays at the same offset into the mapping, but if it moves, the
+    // payload's old alignment is not kept. realloc doesn't promise that
+    char* start = getMappingStart(block);
+    size_t offset = (char*)block - start;
+    size_t oldMapSize = getBlockPayload(block) + MASKED_VALUE(block->size) - start;
+    size_t mapSize = next_page_value(offset + BLOCK_OVERHEAD + s);
+    if(mapSize < s) {
+        return 0;   // overflowed
+    }
+    if(mapSize != oldMapSize) {
+        char* m = mremap(start, oldMapSize, mapSize, MREMAP_MAYMOVE);
+        if(m == MAP_FAILED) {
+            return 0;
+        }
+        block = (blockHeader*)(m + offset);
+        block->size = (mapSize - offset - BLOCK_OVERHEAD) | (block->size & ~HIGHBITS);
+        statDirect(0, (ssize_t)mapSize - (ssize_t)oldMapSize);
+    }
+    return getBlockPayload(block);
+}
+
+void* arenaMalloc(arena* a, size_t s) {
+    // s is aligned and nonzero, and already rounded up to a slab class if
+    // it's small enough for one. caller holds a->lock
+    if(s <= SLAB_MAX_SIZE && slabRegion) {
+        void* p = slabMalloc(a, slabClassOf[s/ALIGNMENT]);
+        if(p) {
+            return p;
+        }
+        // out of slabs, a block will do
+    }
+    blockHeader* block = blockMalloc(a, s);
+    return block ? getBlockPayload(block) : 0;
+}
+
+void arenaFree(void* p) {
+    // caller holds the lock of p's arena
+    if(isSlabPointer(p)) {
+        slabFree(p);
+    } else {
+        blockFree(getPayloadBlock(p));
+    }
+}
+
+arena* getOwner(void* p) {
+    if(isSlabPointer(p)) {
+        return getSlab(p)->arena;
+    }
+    return getPayloadBlock(p)->arena;
+}
+
+size_t getUsableSize(void* p) {
+    if(isSlabPointer(p)) {
+        return slabClassSize[getSlab(p)->sizeClass];
+    }
+    return MASKED_VALUE(getPayloadBlock(p)->size);
+}
+
+#ifdef SCARY_TRACE
+uint64_t traceTime(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+#endif
+}
+
+void traceFlush(void) {
+    // straight to the file with write, since stdio could call malloc
+    const char* buf = (const char*)trace.events;
+    size_t left = trace.count*sizeof(scaryTraceEvent);
+    if(traceFd < 0) {
+        return;   // no file, the buffer just wraps around
+    }
+    while(left) {
+        ssize_t n = write(traceFd, buf, left);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            break;   // nowhere to complain to. drop them
+        }
+        buf += n;
+        left -= n;
+    }
+    trace.count = 0;
+}
+
+void traceEvent(int op, void* ptr, void* old, size_t size) {
+    // record a call. ptr has to still be valid, so frees get traced first
+    int savedErrno = errno;
+    if(!trace.events) {
+        void* m = mmap(0, TRACE_BUFFER_EVENTS*sizeof(scaryTraceEvent), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(m == MAP_FAILED) {
+            return;
+        }
+        trace.events = (scaryTraceEvent*)m;
+        trace.thread = __atomic_fetch_add(&nextTraceThread, 1, __ATOMIC_RELAXED);
+        if(tcache.state == TCACHE_UNUSED) {
+            // so the exit hook runs and flushes us, even if we never
+            // touch the thread cache
+            pthread_setspecific(tcacheKey, &tcache);
+        }
+    }
+    if(trace.count == TRACE_BUFFER_EVENTS) {
+        traceFlush();
+        trace.count = 0;   // if it didn't go anywhere, overwrite the oldest
+    }
+    scaryTraceEvent* e = &trace.events[trace.count++];
+    e->time = traceTime();
+    e->ptr = (uintptr_t)ptr;
+    e->old = (uintptr_t)old;
+    e->size = size;
+    e->thread = trace.thread;
+    e->op = op;
+    e->flags = trace.newChunk ? SCARY_TRACE_NEWCHUNK : 0;
+    trace.newChunk = 0;
+    if(!ptr) {
+        e->bucket = SCARY_TRACE_NONE;
+    } else if(isSlabPointer(ptr)) {
+        e->bucket = SCARY_TRACE_SLAB | getSlab(ptr)->sizeClass;
+    } else if(isMmapped(getPayloadBlock(ptr))) {
+        e->bucket = SCARY_TRACE_DIRECT;
+    } else {
+        int fl, sl;
+        getBucket(MASKED_VALUE(getPayloadBlock(ptr)->size), &fl, &sl);
+        e->bucket = fl*SL_INDEX_COUNT + sl;
+    }
+    errno = savedErrno;
+}
+
+void initTrace(void) {
+    const char* env = getenv("SCARYMALLOC_TRACE");
+    if(env && *env) {
+        traceFd = open(env, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    }
+}
+
+__attribute__((destructor)) void traceAtExit(void) {
+    // other threads still running at exit lose whatever they haven't flushed
+    traceFlush();
+}
+#endif
+
+void scary_trace_flush(void) {
+#ifdef SCARY_TRACE
+    traceFlush();
+#endif
+}
+
+void drainRemoteFrees(arena* a) {
+    // caller holds a->lock
+    void* p = __atomic_exchange_n(&a->remoteFrees, 0, __ATOMIC_ACQUIRE);
+    while(p) {
+        void* next = *(void**)p;
+        arenaFree(p);
+        p = next;
+    }
+}
+
+void lockArena(arena* a) {
+    // every time someone gets the lock, they clean up after other threads,
+    // and see if any pages are due to go back to the kernel
+    pthread_mutex_lock(&a->lock);
+    maybePurge(a);
+    if(__atomic_load_n(&a->remoteFrees, __ATOMIC_RELAXED)) {
+        drainRemoteFrees(a);
+    }
+}
+
+void remoteFree(arena* a, void* p) {
+    // lock-free push onto a->remoteFrees. any number of threads can do this
+    // at once, and the only consumer takes the whole list
+    void* head = __atomic_load_n(&a->remoteFrees, __ATOMIC_RELAXED);
+    do {
+        *(void**)p = head;
+    } while(!__atomic_compare_exchange_n(&a->remoteFrees, &head, p, 1,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void tcacheFlush(tcacheBin* bin, unsigned int n) {
+    // hand n blocks from bin back to their arenas, taking each lock once
+    // per run of blocks from the same arena (usually all of them)
+    arena* locked = 0;
+    while(n-- && bin->head) {
+        void* p = bin->head;
+        bin->head = *(void**)p;
+        bin->count--;
+        arena* owner = getOwner(p);
+        if(owner != locked) {
+            if(locked) { pthread_mutex_unlock(&locked->lock); }
+            locked = owner;
+            lockArena(locked);
+        }
+        arenaFree(p);
+    }
+    if(locked) { pthread_mutex_unlock(&locked->lock); }
+}
+
+void tcacheThreadExit(void* unused) {
+    (void)unused;
+    int i;
+    // anything freed from later destructors goes straight to the arenas
+    tcache.state = TCACHE_DEAD;
+    for(i=0; i<TCACHE_BINS; ++i) {
+        tcacheFlush(&tcache.bins[i], tcache.bins[i].count);
+    }
+#ifdef SCARY_TRACE
+    if(trace.events) {
+        traceFlush();
+        munmap(trace.events, TRACE_BUFFER_EVENTS*sizeof(scaryTraceEvent));
+        trace.events = 0;
+    }
+#endif
+}
+
+int tcacheUsable(void) {
+    if(tcache.state == TCACHE_ACTIVE) {
+        return 1;
+    }
+    if(tcache.state == TCACHE_UNUSED) {
+        // only needs a non-null value for the destructor to fire
+        pthread_setspecific(tcacheKey, &tcache);
+        tcache.state = TCACHE_ACTIVE;
+        return 1;
+    }
+    return 0;
+}
+
+void* tcacheRefill(arena* a, tcacheBin* bin, size_t s) {
+    // get a batch of size-s blocks under one lock. returns one of them,
+    // and leaves the rest in bin
+    int i;
+    void* first = 0;
+    lockArena(a);
+    for(i=0; i<TCACHE_BATCH; ++i) {
+        void* p = arenaMalloc(a, s);
+        if(!p) {
+            break;
+        }
+        if(!first) {
+            first = p;
+        } else {
+            *(void**)p = bin->head;
+            bin->head = p;
+            bin->count++;
+        }
+    }
+    pthread_mutex_unlock(&a->lock);
+    return first;
+}
+
+void doFree(void* p);
+void dumpProfileFile(void);
+
+double approxLog2(double x) {
+    // good to a few thousandths, which is plenty for picking sample points,
+    // and saves dragging in libm. x > 0
+    union { double d; uint64_t u; } bits = { x };
+    int exponent = (int)((bits.u >> 52) & 0x7ff) - 1023;
+    bits.u = (bits.u & ((1ull << 52) - 1)) | (1023ull << 52);   // now in [1, 2)
+    double m = bits.d;
+    // a quadratic fit to log2 over [1, 2)
+    return exponent + (-0.34484843*m + 2.02466578)*m - 1.67487759;
+}
+
+int64_t nextSampleInterval(profileThread* t) {
+    // exponentially distributed with mean profileRate, so every byte
+    // allocated is equally likely to be the one that's sampled
+    t->random ^= t->random << 13;
+    t->random ^= t->random >> 7;
+    t->random ^= t->random << 17;
+    double u = (double)((t->random >> 11) + 1) / (double)(1ull << 53);  // (0, 1]
+    double interval = -approxLog2(u)*0.6931471805599453*(double)profileRate;
+    if(interval > (double)INT64_MAX/2) {
+        interval = (double)INT64_MAX/2;
+    }
+    return (int64_t)interval + 1;
+}
+
+void lockProfile(void) {
+    // only ever held for a moment, except while dumping
+    while(__atomic_exchange_n(&profileLocked, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+void dumpPendingProfile(void) {
+    // if a dump signal came in while someone had the table, it's ours to do
+    while(__atomic_load_n(&profileDumpPending, __ATOMIC_RELAXED)
+            && !__atomic_exchange_n(&profileLocked, 1, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&profileDumpPending, 0, __ATOMIC_RELAXED);
+        dumpProfileFile();
+        __atomic_store_n(&profileLocked, 0, __ATOMIC_RELEASE);
+    }
+}
+
+void unlockProfile(void) {
+    __atomic_store_n(&profileLocked, 0, __ATOMIC_RELEASE);
+    dumpPendingProfile();
+}
+
+void profileSignal(int sig) {
+    // SCARYMALLOC_PROFILE_SIGNAL. dump now if nobody has the table,
+    // otherwise whoever does will when they let go
+    (void)sig;
+    int savedErrno = errno;
+    __atomic_store_n(&profileDumpPending, 1, __ATOMIC_RELAXED);
+    dumpPendingProfile();
+    errno = savedErrno;
+}
+
+profileSample** getProfileBucket(void* p) {
+    return &profileBuckets[((uintptr_t)p >> 4)*0x9e3779b97f4a7c15ull >> 50];
+}
+
+void setSampled(blockHeader* block, int sampled) {
+    // an arena block's size also has the previous-is-free bit in it, which
+    // its neighbors change under their arena's lock, so we need it too
+    arena* a = isMmapped(block) ? 0 : block->arena;
+    if(a) {
+        pthread_mutex_lock(&a->lock);
+    }
+    if(sampled) {
+        block->size |= SAMPLEDBIT;
+    } else {
+        block->size &= ~SAMPLEDBIT;
+    }
+    if(a) {
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+void* sampleAllocation(void* p, size_t n, void* caller) {
+    // p was just allocated, and took this thread's countdown past zero.
+    // returns p, or where it got moved to
+    profileThread* t = &profiler;
+    if(!t->random) {
+        // first time for this thread. just start counting
+        t->random = ((uintptr_t)t ^ nowMs()) | 1;
+        t->countdown = nextSampleInterval(t);
+        return p;
+    }
+    t->countdown = nextSampleInterval(t);
+    if(t->busy) {
+        // backtrace itself can malloc
+        return p;
+    }
+    t->busy = 1;
+    if(isSlabPointer(p)) {
+        // slab objects have no header to mark, so sampled ones get a block
+        arena* a = getThreadArena();
+        lockArena(a);
+        blockHeader* block = blockMalloc(a, next_aligned_value(n));
+        pthread_mutex_unlock(&a->lock);
+        if(!block) {
+            t->busy = 0;
+            return p;
+        }
+        memcpy(getBlockPayload(block), p, n);
+        doFree(p);
+        p = getBlockPayload(block);
+    }
+    // the stack starts at whoever called into us; everything before that
+    // is our own
+    void* stack[PROFILE_DEPTH + 8];
+    int depth = backtrace(stack, PROFILE_DEPTH + 8);
+    int skip = 0;
+    while(skip < depth && stack[skip] != caller) {
+        skip++;
+    }
+    if(skip == depth) {
+        skip = 0;
+    }
+    depth -= skip;
+    if(depth > PROFILE_DEPTH) {
+        depth = PROFILE_DEPTH;
+    }
+    lockProfile();
+    profileSample* sample = profileFree;
+    if(sample) {
+        profileFree = sample->next;
+    } else if(profileUsed < PROFILE_SAMPLES) {
+        sample = &profileTable[profileUsed++];
+    }
+    if(sample) {
+        sample->ptr = p;
+        sample->size = n;
+        sample->depth = depth;
+        memcpy(sample->stack, stack + skip, depth*sizeof(void*));
+        profileSample** bucket = getProfileBucket(p);
+        sample->next = *bucket;
+        *bucket = sample;
+        profileObjects++;
+        profileBytes += n;
+    }
+    unlockProfile();
+    if(sample) {
+        // only once it's in the table, so free always finds it
+        setSampled(getPayloadBlock(p), 1);
+    }
+    t->busy = 0;
+    return p;
+}
+
+void* maybeSample(void* p, size_t n, void* caller) {
+    // every allocating entry point goes through this. caller is its
+    // return address
+    if(!profileRate || !p) {
+        return p;
+    }
+    profiler.countdown -= n;
+    if(profiler.countdown >= 0) {
+        return p;
+    }
+    return sampleAllocation(p, n, caller);
+}
+
+#define SAMPLE(p, n) maybeSample(p, n, __builtin_return_address(0))
+
+void dropSample(void* p) {
+    // p is being freed or resized, so its sample is over
+    lockProfile();
+    profileSample** link = getProfileBucket(p);
+    while(*link && (*link)->ptr != p) {
+        link = &(*link)->next;
+    }
+    profileSample* sample = *link;
+    if(sample) {
+        *link = sample->next;
+        sample->next = profileFree;
+        profileFree = sample;
+        profileObjects--;
+        profileBytes -= sample->size;
+    }
+    unlockProfile();
+    setSampled(getPayloadBlock(p), 0);
+}
+
+int isSampled(void* p) {
+    // slab objects never are, see sampleAllocation
+    return !isSlabPointer(p) && (getPayloadBlock(p)->size & SAMPLEDBIT);
+}
+
+void* doMalloc(size_t s) {
+    // malloc, minus the tracing, for the other entry points to build on
+    void* ret;
+    s = next_aligned_value(s); // we only want to allocate aligned-size blocks, to keep
+                               // all the headers and payloads aligned
+    if(!s) { return 0; }
+    //printf("mallocing %lu bytes\n", s);
+    arena* a = getThreadArena();
+    if(s <= SLAB_MAX_SIZE && slabRegion) {
+        s = slabClassSize[slabClassOf[s/ALIGNMENT]];
+    }
+    if(s >= __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED)) {
+        ret = directMalloc(s);
+    } else if(s <= TCACHE_MAX_SIZE && tcacheUsable()) {
+        tcacheBin* bin = &tcache.bins[s/ALIGNMENT - 1];
+        if(bin->head) {
+            ret = bin->head;
+            bin->head = *(void**)ret;
+            bin->count--;
+        } else {
+            ret = tcacheRefill(a, bin, s);
+        }
+    } else {
+        lockArena(a);
+        ret = arenaMalloc(a, s);
+        pthread_mutex_unlock(&a->lock);
+    }
+    if(!ret) {
+        errno = ENOMEM;
+        return 0;
+    }
+    return ret;
+}
+
+void doFree(void* p) {
+    if(!p) {
+        return;
+    }
+    if(!isSlabPointer(p) && (getPayloadBlock(p)->size & (MMAPPEDBIT | SAMPLEDBIT))) {
+        if(getPayloadBlock(p)->size & SAMPLEDBIT) {
+            dropSample(p);
+        }
+        if(isMmapped(getPayloadBlock(p))) {
+            directFree(getPayloadBlock(p));
+            return;
+        }
+    }
+    // back to whichever arena it came from, no matter which thread we are
+    arena* a = getOwner(p);
+    if(a != getThreadArena()) {
+        // not ours, let the owner deal with it next time they have the lock
+        remoteFree(a, p);
+        return;
+    }
+    size_t s = getUsableSize(p);
+    if(s <= TCACHE_MAX_SIZE && tcacheUsable()) {
+        tcacheBin* bin = &tcache.bins[s/ALIGNMENT - 1];
+        *(void**)p = bin->head;
+        bin->head = p;
+        bin->count++;
+        if(bin->count > TCACHE_LIMIT) {
+            tcacheFlush(bin, TCACHE_BATCH);
+        }
+        return;
+    }
+    lockArena(a);
+    arenaFree(p);
+    pthread_mutex_unlock(&a->lock);
+}
+
+void* malloc(size_t s) {
+    void* ret = SAMPLE(doMalloc(s), s);
+    TRACE(SCARY_TRACE_MALLOC, ret, 0, s);
+    return ret;
+}
+
+void free(void* p) {
+    if(p) {
+        TRACE(SCARY_TRACE_FREE, p, 0, 0);
+    }
+    doFree(p);
+}
+
+void doFreeSized(void* p, size_t size, size_t align) {
+    // free, told how big p is (and how aligned, or 0). that would save
+    // looking the size up, but p's header or slab has to be read anyway for
+    // its arena and flags, and the size is right next to those. so this
+    // just checks the caller has it right
+    if(!p) {
+        return;
+    }
+    assert(getUsableSize(p) >= size);
+    assert(!((uintptr_t)p & ((align ? align : 1) - 1)));
+    (void)size;
+    (void)align;
+    TRACE(SCARY_TRACE_FREE, p, 0, 0);
+    doFree(p);
+}
+
+void free_sized(void* p, size_t size) {
+    doFreeSized(p, size, 0);
+}
+
+void free_aligned_sized(void* p, size_t alignment, size_t size) {
+    doFreeSized(p, size, alignment);
+}
+
+void* doCalloc(size_t n) {
+    // malloc, but zeroed. fresh memory from the kernel is zero already, so
+    // only clear the parts of the block that aren't known to be
+    size_t s = next_aligned_value(n);
+    if(s > TCACHE_MAX_SIZE && s < __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED)) {
+        // blocks small enough for the thread cache or a slab aren't worth
+        // keeping track of, and have just been used by someone anyway
+        arena* a = getThreadArena();
+        lockArena(a);
+        blockHeader* block = blockMalloc(a, s);
+        pthread_mutex_unlock(&a->lock);
+        if(!block) {
+            errno = ENOMEM;
+            return 0;
+        }
+        // nothing's been written to the payload since it was free, so its
+        // purge info and footer are still there
+        char* payload = getBlockPayload(block);
+        size_t zeroFrom = getZeroFrom(block) - payload;
+        size_t footer = (char*)getFooter(block) - payload;
+        if(zeroFrom >= footer) {
+            zeroFrom = footer = n;
+        }
+        memset(payload, 0, zeroFrom < n ? zeroFrom : n);
+        if(footer < n) {
+            memset(payload + footer, 0, n - footer);
+        }
+        return payload;
+    }
+    void* ret = doMalloc(n);
+    if(ret && (isSlabPointer(ret) || !isMmapped(getPayloadBlock(ret)))) {
+        // direct blocks are a fresh mapping every time
+        memset(ret, 0, n);
+    }
+    return ret;
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    size_t n;
+    if(__builtin_mul_overflow(nmemb, size, &n)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if(n == 0) {
+        return NULL;
+    }
+    void* ret = SAMPLE(doCalloc(n), n);
+    TRACE(SCARY_TRACE_CALLOC, ret, 0, n);
+    return ret;
+}
+
+void* doRealloc(void* ptr, size_t newsize) {
+    if(!ptr) {
+        return doMalloc(newsize);
+    }
+    if(!newsize) {
+        doFree(ptr);
+        return 0;
+    }
+    size_t s = next_aligned_value(newsize);
+    if(!s) {
+        errno = ENOMEM;
+        return 0;
+    }
+    if(isSlabPointer(ptr)) {
+        // objects can't change size, but the one we've got might already
+        // be the right size class
+        if(s <= SLAB_MAX_SIZE && slabClassOf[s/ALIGNMENT] == getSlab(ptr)->sizeClass) {
+            return ptr;
+        }
+    } else if(isMmapped(getPayloadBlock(ptr))) {
+        void* ret = directRealloc(getPayloadBlock(ptr), s);
+        if(!ret) {
+            errno = ENOMEM;
+        }
+        return ret;
+    } else {
+        // resize in place if we can. the block stays in whatever arena it
+        // came from, so that's the lock we need
+        blockHeader* block = getPayloadBlock(ptr);
+        arena* a = block->arena;
+        int done = 1;
+        lockArena(a);
+        if(s <= MASKED_VALUE(block->size)) {
+            shrinkBlock(block, s);
+        } else if(s < __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED)) {
+            done = growBlock(block, s);
+        } else {
+            // malloc would give something this big a mapping of its own,
+            // so let it, or fail cleanly if it's just too big
+            done = 0;
+        }
+        pthread_mutex_unlock(&a->lock);
+        if(done) {
+            return ptr;
+        }
+    }
+    // no luck, it has to move
+    void* newmem = doMalloc(newsize);
+    if(!newmem) { return 0; }
+    size_t oldsize = getUsableSize(ptr);
+    memcpy(newmem, ptr, oldsize < newsize ? oldsize : newsize);
+    doFree(ptr);
+    return newmem;
+}
+
+void* realloc(void* ptr, size_t newsize) {
+    if(profileRate && ptr && isSampled(ptr)) {
+        // whatever it turns into gets its own chance to be sampled
+        dropSample(ptr);
+    }
+    void* ret = SAMPLE(doRealloc(ptr, newsize), newsize);
+    TRACE(SCARY_TRACE_REALLOC, ret, ptr, newsize);
+    return ret;
+}
+
+void* alignedMalloc(size_t align, size_t s) {
+    // align is a power of two, or anything up to ALIGNMENT
+    if(align <= (size_t)ALIGNMENT) {
+        // malloc(0) can say no, but we have to hand something back
+        return doMalloc(s ? s : 1);
+    }
+    void* ret;
+    if(s > SIZE_MAX - align - BLOCK_OVERHEAD - MIN_PAYLOAD - pageSize) {
+        // way too big, and all the size math below would overflow
+        errno = ENOMEM;
+        return 0;
+    }
+    s = next_aligned_value(s);
+    if(!s) {
+        s = ALIGNMENT;   // same as above
+    }
+    arena* a = getThreadArena();
+    if(s + align >= __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED)) {
+        ret = directAlignedMalloc(align, s);
+    } else {
+        // slab objects are only 16-aligned, and the thread cache doesn't
+        // know about alignment, so these always come from the arena
+        lockArena(a);
+        blockHeader* block = blockMallocAligned(a, align, s);
+        pthread_mutex_unlock(&a->lock);
+        ret = block ? getBlockPayload(block) : 0;
+    }
+    if(!ret) {
+        errno = ENOMEM;
+    }
+    return ret;
+}
+
+int isPowerOfTwo(size_t n) {
+    return n && !(n & (n - 1));
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if(!isPowerOfTwo(alignment) || alignment % sizeof(void*)) {
+        return EINVAL;
+    }
+    int savedErrno = errno;   // posix_memalign reports errors by return value only
+    void* p = SAMPLE(alignedMalloc(alignment, size), size);
+    TRACE(SCARY_TRACE_MEMALIGN, p, (void*)alignment, size);
+    errno = savedErrno;
+    if(!p) {
+        return ENOMEM;
+    }
+    *memptr = p;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    if(!isPowerOfTwo(alignment)) {
+        errno = EINVAL;
+        return 0;
+    }
+    void* ret = SAMPLE(alignedMalloc(alignment, size), size);
+    TRACE(SCARY_TRACE_MEMALIGN, ret, (void*)alignment, size);
+    return ret;
+}
+
+void* memalign(size_t alignment, size_t size) {
+    // glibc rounds a bad alignment up instead of failing, so we do too
+    if(alignment > (size_t)ALIGNMENT && !isPowerOfTwo(alignment)) {
+        if(alignment > SIZE_MAX/2 + 1) {
+            errno = EINVAL;
+            return 0;
+        }
+        alignment = (size_t)1 << (floorLog2(alignment) + 1);
+    }
+    void* ret = SAMPLE(alignedMalloc(alignment, size), size);
+    TRACE(SCARY_TRACE_MEMALIGN, ret, (void*)alignment, size);
+    return ret;
+}
+
+void* valloc(size_t size) {
+    getThreadArena();   // so pageSize is set
+    void* ret = SAMPLE(alignedMalloc(pageSize, size), size);
+    TRACE(SCARY_TRACE_MEMALIGN, ret, (void*)pageSize, size);
+    return ret;
+}
+
+void* pvalloc(size_t size) {
+    getThreadArena();
+    size_t rounded = next_page_value(size);
+    if(rounded < size) {
+        errno = ENOMEM;
+        return 0;
+    }
+    void* ret = SAMPLE(alignedMalloc(pageSize, rounded ? rounded : pageSize), size);
+    TRACE(SCARY_TRACE_MEMALIGN, ret, (void*)pageSize, size);
+    return ret;
+}
+
+size_t malloc_usable_size(void* p) {
+    // the whole payload is the caller's to use, not just what they asked for
+    if(!p) {
+        return 0;
+    }
+    return getUsableSize(p);
+}
+
+int malloc_trim(size_t pad) {
+    // purge every free page right now, and unmap free space at the ends
+    // of the arenas. returns 1 if any memory was released
+    int i;
+    size_t released = 0;
+    if(!__atomic_load_n(&arenasReady, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    if(tcache.state == TCACHE_ACTIVE) {
+        // can't get at other threads' caches, but we can empty our own
+        for(i=0; i<TCACHE_BINS; ++i) {
+            tcacheFlush(&tcache.bins[i], tcache.bins[i].count);
+        }
+    }
+    for(i=0; i<numArenas; ++i) {
+        lockArena(&arenas[i]);
+        consolidateFastBins(&arenas[i]);
+        released += trimArena(&arenas[i], pad);
+        released += purgeArena(&arenas[i], 1);
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    released += purgeSlabPool(0, 1);
+    return released != 0;
+}
+
+size_t scary_malloc_batch(size_t size, size_t n, void** ptrs) {
+    // n objects of the same size, under one lock. blocks come out of one
+    // free block wherever that's possible, which also leaves them next to
+    // each other for scary_free_batch to give back in one piece
+    size_t got = 0, i;
+    size_t s = next_aligned_value(size);
+    if(!s || !n) {
+        return 0;
+    }
+    arena* a = getThreadArena();
+    if(s <= SLAB_MAX_SIZE && slabRegion) {
+        s = slabClassSize[slabClassOf[s/ALIGNMENT]];
+    }
+    if(s >= __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED)) {
+        // mappings of their own, there's nothing to share
+        while(got < n && (ptrs[got] = directMalloc(s))) {
+            got++;
+        }
+    } else {
+        lockArena(a);
+        if(!(s <= SLAB_MAX_SIZE && slabRegion)) {
+            got = blockMallocBatch(a, s, n, ptrs);
+        }
+        // slab objects, or blocks one at a time if they didn't all fit in one
+        while(got < n && (ptrs[got] = arenaMalloc(a, s))) {
+            got++;
+        }
+        pthread_mutex_unlock(&a->lock);
+    }
+    if(got < n) {
+        errno = ENOMEM;
+    }
+    for(i=0; i<got; ++i) {
+        ptrs[i] = SAMPLE(ptrs[i], size);
+        TRACE(SCARY_TRACE_MALLOC, ptrs[i], 0, size);
+    }
+    return got;
+}
+
+void siftDown(void** p, size_t root, size_t n) {
+    for(;;) {
+        size_t child = 2*root + 1;
+        if(child >= n) {
+            return;
+        }
+        if(child + 1 < n && (uintptr_t)p[child + 1] > (uintptr_t)p[child]) {
+            child++;
+        }
+        if((uintptr_t)p[root] >= (uintptr_t)p[child]) {
+            return;
+        }
+        void* t = p[root];
+        p[root] = p[child];
+        p[child] = t;
+        root = child;
+    }
+}
+
+void sortPointers(void** p, size_t n) {
+    // heapsort by address. in place and no recursion, and qsort is allowed
+    // to malloc, which we can't have here
+    size_t i;
+    for(i=n/2; i-->0; ) {
+        siftDown(p, i, n);
+    }
+    for(i=n; i-->1; ) {
+        void* t = p[0];
+        p[0] = p[i];
+        p[i] = t;
+        siftDown(p, 0, i);
+    }
+}
+
+void scary_free_batch(void** ptrs, size_t n) {
+    // free everything in ptrs. sorting by address groups the pointers by
+    // arena, and puts blocks that are right next to each other together,
+    // so each run of them is merged and rebucketed once. skips the thread
+    // cache, since most of this would only be flushed back out of it
+    size_t i, j;
+    // the odd ones out first: samples to drop, and blocks with mappings
+    // of their own. dropSample takes the arena lock itself
+    for(i=0; i<n; ++i) {
+        void* p = ptrs[i];
+        if(!p) {
+            continue;
+        }
+        TRACE(SCARY_TRACE_FREE, p, 0, 0);
+        if(!isSlabPointer(p) && (getPayloadBlock(p)->size & (MMAPPEDBIT | SAMPLEDBIT))) {
+            if(getPayloadBlock(p)->size & SAMPLEDBIT) {
+                dropSample(p);
+            }
+            if(isMmapped(getPayloadBlock(p))) {
+                directFree(getPayloadBlock(p));
+                ptrs[i] = 0;
+            }
+        }
+    }
+    sortPointers(ptrs, n);
+    arena* locked = 0;
+    for(i=0; i<n; i=j) {
+        void* p = ptrs[i];
+        j = i + 1;
+        if(!p) {
+            continue;
+        }
+        arena* owner = getOwner(p);
+        if(owner != locked) {
+            if(locked) { pthread_mutex_unlock(&locked->lock); }
+            locked = owner;
+            lockArena(locked);
+        }
+        if(isSlabPointer(p)) {
+            slabFree(p);
+            continue;
+        }
+        blockHeader* last = getPayloadBlock(p);
+        while(j < n && ptrs[j] == getBlockPayload(getPhysicalNext(last))) {
+            last = getPayloadBlock(ptrs[j++]);
+        }
+        blockFreeRun(getPayloadBlock(p), last);
+    }
+    if(locked) { pthread_mutex_unlock(&locked->lock); }
+}
+
+/*
+   Regions. Allocating is a compare and an add on the bump pointer, and
+   nothing is freed until the whole region is: one free per block, instead
+   of one per object, each with its coallescing and rebucketing.
+*/
+regionBlock* regionNewBlock(size_t size) {
+    if(size > SIZE_MAX - sizeof(regionBlock)) {
+        return 0;
+    }
+    regionBlock* b = doMalloc(sizeof(regionBlock) + size);
+    if(b) {
+        // whatever rounding up malloc did is ours to use too
+        b->size = getUsableSize(b) - sizeof(regionBlock);
+    }
+    return b;
+}
+
+void regionFreeBlocks(regionBlock* b) {
+    while(b) {
+        regionBlock* next = b->next;
+        doFree(b);
+        b = next;
+    }
+}
+
+scaryRegion* scary_region_create(void) {
+    // the first block waits for the first allocation
+    scaryRegion* r = doMalloc(sizeof(scaryRegion));
+    if(r) {
+        r->blocks = 0;
+        r->next = 0;
+        r->end = 0;
+        r->blockSize = REGION_MIN_BLOCK;
+    }
+    return r;
+}
+
+void* regionAllocSlow(scaryRegion* r, size_t s) {
+    // the block we're bumping through is full, or there isn't one yet
+    regionBlock* b;
+    if(r->blocks && s > r->blockSize/4) {
+        // big enough that starting a new block for it would waste most of
+        // the current one. it gets a block of its own, behind the current
+        // one, which we carry on bumping through
+        b = regionNewBlock(s);
+        if(!b) {
+            errno = ENOMEM;
+            return 0;
+        }
+        b->next = r->blocks->next;
+        r->blocks->next = b;
+        return b + 1;
+    }
+    b = regionNewBlock(s > r->blockSize ? s : r->blockSize);
+    if(!b) {
+        errno = ENOMEM;
+        return 0;
+    }
+    if(r->blockSize < REGION_MAX_BLOCK) {
+        r->blockSize *= 2;
+    }
+    b->next = r->blocks;
+    r->blocks = b;
+    r->next = (char*)(b + 1) + s;
+    r->end = (char*)(b + 1) + b->size;
+    return b + 1;
+}
+
+void* scary_region_alloc(scaryRegion* r, size_t size) {
+    size_t s = next_aligned_value(size);
+    if(s < size) {
+        errno = ENOMEM;   // overflowed
+        return 0;
+    }
+    if(!s) {
+        s = ALIGNMENT;    // every allocation gets a pointer of its own
+    }
+    if(s <= (size_t)(r->end - r->next)) {
+        void* p = r->next;
+        r->next += s;
+        return p;
+    }
+    return regionAllocSlow(r, s);
+}
+
+void scary_region_reset(scaryRegion* r) {
+    // keep the block we were bumping through, which is the biggest one
+    // unless some single allocation was bigger, and start it over
+    regionBlock* b = r->blocks;
+    if(!b) {
+        return;
+    }
+    regionFreeBlocks(b->next);
+    b->next = 0;
+    r->next = (char*)(b + 1);
+    r->end = r->next + b->size;
+}
+
+void scary_region_destroy(scaryRegion* r) {
+    if(r) {
+        regionFreeBlocks(r->blocks);
+        doFree(r);
+    }
+}
+
+/*
+   C++ operator new and delete, every standard variant, under their
+   mangled names (for LP64, where size_t is an unsigned long), so C++
+   programs come straight here instead of through libstdc++'s versions,
+   which just call malloc and free. Running out of memory works the way
+   the standard says: call the new handler and try again, and if there
+   isn't one, throw std::bad_alloc. Both of those come from libstdc++, as
+   weak references, since a C program has neither (nor anything that
+   would call these). The exception unwinds through our frames, so this
+   file needs building with -fexceptions. The nothrow versions just return
+   0 instead, without trying the handler, since catching what it throws
+   isn't something C can do.
+*/
+typedef void (*newHandler)(void);
+newHandler _ZSt15get_new_handlerv(void) __attribute__((weak));
+void _ZSt17__throw_bad_allocv(void) __attribute__((weak, noreturn));
+
+void* cppNew(size_t n, size_t align, int nothrow, void* caller) {
+    void* ret;
+    for(;;) {
+        // new of 0 bytes still has to come back with a unique pointer
+        ret = align ? alignedMalloc(align, n ? n : 1) : doMalloc(n ? n : 1);
+        if(ret || nothrow) {
+            break;
+        }
+        newHandler handler = _ZSt15get_new_handlerv ? _ZSt15get_new_handlerv() : 0;
+        if(!handler) {
+            if(_ZSt17__throw_bad_allocv) {
+                _ZSt17__throw_bad_allocv();
+            }
+            abort();
+        }
+        handler();
+    }
+    ret = maybeSample(ret, n, caller);
+    if(align) {
+        TRACE(SCARY_TRACE_MEMALIGN, ret, (void*)align, n);
+    } else {
+        TRACE(SCARY_TRACE_MALLOC, ret, 0, n);
+    }
+    return ret;
+}
+
+// operator new(size_t), new[], and the nothrow_t and align_val_t versions
+void* _Znwm(size_t n) { return cppNew(n, 0, 0, __builtin_return_address(0)); }
+void* _Znam(size_t n) { return cppNew(n, 0, 0, __builtin_return_address(0)); }
+void* _ZnwmRKSt9nothrow_t(size_t n, const void* nt) { (void)nt; return cppNew(n, 0, 1, __builtin_return_address(0)); }
+void* _ZnamRKSt9nothrow_t(size_t n, const void* nt) { (void)nt; return cppNew(n, 0, 1, __builtin_return_address(0)); }
+void* _ZnwmSt11align_val_t(size_t n, size_t align) { return cppNew(n, align, 0, __builtin_return_address(0)); }
+void* _ZnamSt11align_val_t(size_t n, size_t align) { return cppNew(n, align, 0, __builtin_return_address(0)); }
+void* _ZnwmSt11align_val_tRKSt9nothrow_t(size_t n, size_t align, const void* nt) { (void)nt; return cppNew(n, align, 1, __builtin_return_address(0)); }
+void* _ZnamSt11align_val_tRKSt9nothrow_t(size_t n, size_t align, const void* nt) { (void)nt; return cppNew(n, align, 1, __builtin_return_address(0)); }
+
+// operator delete(void*), delete[], and the sized, align_val_t and nothrow_t versions
+void _ZdlPv(void* p) { doFreeSized(p, 0, 0); }
+void _ZdaPv(void* p) { doFreeSized(p, 0, 0); }
+void _ZdlPvm(void* p, size_t n) { doFreeSized(p, n, 0); }
+void _ZdaPvm(void* p, size_t n) { doFreeSized(p, n, 0); }
+void _ZdlPvRKSt9nothrow_t(void* p, const void* nt) { (void)nt; doFreeSized(p, 0, 0); }
+void _ZdaPvRKSt9nothrow_t(void* p, const void* nt) { (void)nt; doFreeSized(p, 0, 0); }
+void _ZdlPvSt11align_val_t(void* p, size_t align) { doFreeSized(p, 0, align); }
+void _ZdaPvSt11align_val_t(void* p, size_t align) { doFreeSized(p, 0, align); }
+void _ZdlPvmSt11align_val_t(void* p, size_t n, size_t align) { doFreeSized(p, n, align); }
+void _ZdaPvmSt11align_val_t(void* p, size_t n, size_t align) { doFreeSized(p, n, align); }
+void _ZdlPvSt11align_val_tRKSt9nothrow_t(void* p, size_t align, const void* nt) { (void)nt; doFreeSized(p, 0, align); }
+void _ZdaPvSt11align_val_tRKSt9nothrow_t(void* p, size_t align, const void* nt) { (void)nt; doFreeSized(p, 0, align); }
+
+/*
+   Statistics. A snapshot takes each arena's lock in turn, adds up its
+   counters and walks its buckets and partial slabs for the free side, so
+   it's only consistent per arena, not across all of them. None of it
+   mallocs, since it has to work from inside malloc_stats and at exit.
+*/
+typedef struct statsSnapshot_t {
+    arenaStats total;      // every arena's counters added up
+    size_t freeBlocks[FL_INDEX_COUNT][SL_INDEX_COUNT];
+    size_t freeBytes[FL_INDEX_COUNT][SL_INDEX_COUNT];
+    size_t slabFreeObjects;
+    size_t slabFreeBytes;
+    size_t fastBlocks;     // also counted in freeBlocks and freeBytes
+    size_t fastBytes;
+    size_t largestFree;    // biggest free block payload
+    size_t topFree;        // free at the very ends of the latest chunks
+} statsSnapshot;
+
+void addArenaStats(arenaStats* total, arenaStats* stats) {
+    int fl, sl;
+    unsigned int c;
+    for(fl=0; fl<FL_INDEX_COUNT; ++fl) {
+        for(sl=0; sl<SL_INDEX_COUNT; ++sl) {
+            total->allocatedBlocks[fl][sl] += stats->allocatedBlocks[fl][sl];
+            total->allocatedBytes[fl][sl] += stats->allocatedBytes[fl][sl];
+        }
+    }
+    for(c=0; c<SLAB_CLASSES; ++c) {
+        total->slabObjects[c] += stats->slabObjects[c];
+    }
+    total->slabs += stats->slabs;
+    total->chunkBytes += stats->chunkBytes;
+    total->chunkMaps += stats->chunkMaps;
+    total->chunkExtends += stats->chunkExtends;
+    total->blockMallocs += stats->blockMallocs;
+    total->blockFrees += stats->blockFrees;
+    total->slabMallocs += stats->slabMallocs;
+    total->slabFrees += stats->slabFrees;
+    total->searchSteps += stats->searchSteps;
+    total->splits += stats->splits;
+    total->coallesces += stats->coallesces;
+}
+
+void takeSnapshot(statsSnapshot* snap) {
+    int i, fl, sl;
+    unsigned int c;
+    memset(snap, 0, sizeof(*snap));
+    if(!__atomic_load_n(&arenasReady, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    for(i=0; i<numArenas; ++i) {
+        arena* a = &arenas[i];
+        lockArena(a);
+        addArenaStats(&snap->total, &a->stats);
+        for(fl=0; fl<FL_INDEX_COUNT; ++fl) {
+            if(!(a->flBitmap & (1ul << fl))) {
+                continue;
+            }
+            for(sl=0; sl<SL_INDEX_COUNT; ++sl) {
+                blockHeader* block = a->buckets[fl][sl].logicalNext;
+                for(; block; block = block->logicalNext) {
+                    size_t size = MASKED_VALUE(block->size);
+                    snap->freeBlocks[fl][sl]++;
+                    snap->freeBytes[fl][sl] += size;
+                    if(size > snap->largestFree) {
+                        snap->largestFree = size;
+                    }
+                }
+            }
+        }
+        for(c=0; c<FASTBIN_COUNT; ++c) {
+            // free as far as the program knows, just not coallesced yet
+            void* p;
+            for(p=a->fastBins[c]; p; p=*(void**)p) {
+                size_t size = MASKED_VALUE(getPayloadBlock(p)->size);
+                getBucket(size, &fl, &sl);
+                snap->freeBlocks[fl][sl]++;
+                snap->freeBytes[fl][sl] += size;
+                if(size > snap->largestFree) {
+                    snap->largestFree = size;
+                }
+                snap->fastBlocks++;
+                snap->fastBytes += size;
+            }
+        }
+        for(c=0; c<SLAB_CLASSES; ++c) {
+            slab* partial;
+            for(partial=a->slabs[c]; partial; partial=partial->next) {
+                size_t left = partial->capacity - partial->used;
+                snap->slabFreeObjects += left;
+                snap->slabFreeBytes += left*slabClassSize[c];
+            }
+        }
+        blockHeader* top = getTop(a);
+        if(top) {
+            size_t size = MASKED_VALUE(top->size);
+            getBucket(size, &fl, &sl);
+            snap->freeBlocks[fl][sl]++;
+            snap->freeBytes[fl][sl] += size;
+            if(size > snap->largestFree) {
+                snap->largestFree = size;
+            }
+            snap->topFree += size;
+        }
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+size_t snapshotAllocatedBytes(statsSnapshot* snap) {
+    // in blocks and slab objects, not counting direct blocks
+    int fl, sl;
+    unsigned int c;
+    size_t bytes = 0;
+    for(fl=0; fl<FL_INDEX_COUNT; ++fl) {
+        for(sl=0; sl<SL_INDEX_COUNT; ++sl) {
+            bytes += snap->total.allocatedBytes[fl][sl];
+        }
+    }
+    for(c=0; c<SLAB_CLASSES; ++c) {
+        bytes += snap->total.slabObjects[c]*slabClassSize[c];
+    }
+    return bytes;
+}
+
+size_t snapshotFreeBytes(statsSnapshot* snap, size_t* blocks) {
+    // in free blocks, not counting slabs
+    int fl, sl;
+    size_t bytes = 0;
+    *blocks = 0;
+    for(fl=0; fl<FL_INDEX_COUNT; ++fl) {
+        for(sl=0; sl<SL_INDEX_COUNT; ++sl) {
+            bytes += snap->freeBytes[fl][sl];
+            *blocks += snap->freeBlocks[fl][sl];
+        }
+    }
+    return bytes;
+}
+
+/*
+   Where stats text goes: either straight to a file descriptor, a buffer's
+   worth at a time, or into the caller's buffer, snprintf style, in which
+   case length keeps counting past the end so the caller knows how much
+   room it would have taken.
+*/
+typedef struct statsOut_t {
+    char* buf;
+    size_t size;
+    size_t length;
+    int fd;        // -1 for the caller's buffer
+} statsOut;
+
+void statsFlush(statsOut* out) {
+    size_t done = 0;
+    while(done < out->length) {
+        ssize_t n = write(out->fd, out->buf + done, out->length - done);
+        if(n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    out->length = 0;
+}
+
+void statsPrintf(statsOut* out, const char* format, ...) {
+    // every line we print is short, so it's always done in one piece
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if(n < 0) {
+        return;
+    }
+    if((size_t)n >= sizeof(line)) {
+        n = sizeof(line) - 1;
+    }
+    if(out->fd >= 0 && out->length + n > out->size) {
+        statsFlush(out);
+    }
+    if(out->length < out->size) {
+        size_t room = out->size - out->length;
+        memcpy(out->buf + out->length, line, (size_t)n < room ? (size_t)n : room);
+    }
+    out->length += n;
+}
+
+double fragmentation(statsSnapshot* snap) {
+    // how much of the free space is in blocks smaller than the biggest
+    // one: 0 if it's all in one piece, close to 1 if it's all crumbs
+    size_t blocks;
+    size_t bytes = snapshotFreeBytes(snap, &blocks);
+    return bytes ? 1.0 - (double)snap->largestFree/bytes : 0.0;
+}
+
+void printStatsText(statsOut* out) {
+    statsSnapshot snap;
+    int fl, sl;
+    unsigned int c;
+    takeSnapshot(&snap);
+    arenaStats* t = &snap.total;
+    size_t freeBlocks;
+    size_t freeBytes = snapshotFreeBytes(&snap, &freeBlocks);
+    uint64_t mallocs = t->blockMallocs;
+    statsPrintf(out, "scarymalloc: %d arenas\n", numArenas);
+    statsPrintf(out, "mapped:      %zu bytes (peak %zu)\n",
+                __atomic_load_n(&mappedBytes, __ATOMIC_RELAXED),
+                __atomic_load_n(&peakMappedBytes, __ATOMIC_RELAXED));
+    statsPrintf(out, "chunks:      %zu bytes, %" PRIu64 " mmaps, %" PRIu64 " extended a chunk\n",
+                t->chunkBytes, t->chunkMaps, t->chunkExtends);
+    statsPrintf(out, "direct:      %zu blocks, %zu bytes, %" PRIu64 " mmaps\n",
+                __atomic_load_n(&directBlocks, __ATOMIC_RELAXED),
+                __atomic_load_n(&directBytes, __ATOMIC_RELAXED),
+                __atomic_load_n(&directMaps, __ATOMIC_RELAXED));
+    statsPrintf(out, "in use:      %zu bytes\n", snapshotAllocatedBytes(&snap));
+    statsPrintf(out, "free:        %zu bytes in %zu blocks, largest %zu, fragmentation %.3f\n",
+                freeBytes, freeBlocks, snap.largestFree, fragmentation(&snap));
+    statsPrintf(out, "blocks:      %" PRIu64 " mallocs, %" PRIu64 " frees, %.2f search steps per malloc\n",
+                t->blockMallocs, t->blockFrees, mallocs ? (double)t->searchSteps/mallocs : 0.0);
+    statsPrintf(out, "             %" PRIu64 " splits, %" PRIu64 " coallesces\n",
+                t->splits, t->coallesces);
+    statsPrintf(out, "slabs:       %zu pages, %" PRIu64 " mallocs, %" PRIu64 " frees, %zu bytes free\n",
+                t->slabs, t->slabMallocs, t->slabFrees, snap.slabFreeBytes);
+    statsPrintf(out, "%12s %10s %14s %10s %14s\n", "bucket", "allocated", "bytes", "free", "bytes");
+    for(fl=0; fl<FL_INDEX_COUNT; ++fl) {
+        for(sl=0; sl<SL_INDEX_COUNT; ++sl) {
+            if(!t->allocatedBlocks[fl][sl] && !snap.freeBlocks[fl][sl]) {
+                continue;
+            }
+            statsPrintf(out, "%12zu %10zu %14zu %10zu %14zu\n", getBucketFloor(fl, sl),
+                        t->allocatedBlocks[fl][sl], t->allocatedBytes[fl][sl],
+                        snap.freeBlocks[fl][sl], snap.freeBytes[fl][sl]);
+        }
+    }
+    statsPrintf(out, "%12s %10s\n", "slab class", "in use");
+    for(c=0; c<SLAB_CLASSES; ++c) {
+        if(t->slabObjects[c]) {
+            statsPrintf(out, "%12zu %10zu\n", slabClassSize[c], t->slabObjects[c]);
+        }
+    }
+}
+
+void printStatsJson(statsOut* out) {
+    statsSnapshot snap;
+    int fl, sl;
+    unsigned int c;
+    const char* sep = "";
+    takeSnapshot(&snap);
+    arenaStats* t = &snap.total;
+    size_t freeBlocks;
+    size_t freeBytes = snapshotFreeBytes(&snap, &freeBlocks);
+    statsPrintf(out, "{\"arenas\":%d,\"mapped\":%zu,\"peak_mapped\":%zu,", numArenas,
+                __atomic_load_n(&mappedBytes, __ATOMIC_RELAXED),
+                __atomic_load_n(&peakMappedBytes, __ATOMIC_RELAXED));
+    statsPrintf(out, "\"chunk_bytes\":%zu,\"chunk_mmaps\":%" PRIu64 ",\"chunk_extends\":%" PRIu64 ",",
+                t->chunkBytes, t->chunkMaps, t->chunkExtends);
+    statsPrintf(out, "\"direct_blocks\":%zu,\"direct_bytes\":%zu,\"direct_mmaps\":%" PRIu64 ",",
+                __atomic_load_n(&directBlocks, __ATOMIC_RELAXED),
+                __atomic_load_n(&directBytes, __ATOMIC_RELAXED),
+                __atomic_load_n(&directMaps, __ATOMIC_RELAXED));
+    statsPrintf(out, "\"allocated_bytes\":%zu,\"free_bytes\":%zu,\"free_blocks\":%zu,",
+                snapshotAllocatedBytes(&snap), freeBytes, freeBlocks);
+    statsPrintf(out, "\"largest_free\":%zu,\"top_free\":%zu,\"fragmentation\":%.4f,",
+                snap.largestFree, snap.topFree, fragmentation(&snap));
+    statsPrintf(out, "\"block_mallocs\":%" PRIu64 ",\"block_frees\":%" PRIu64 ",\"search_steps\":%" PRIu64 ",",
+                t->blockMallocs, t->blockFrees, t->searchSteps);
+    statsPrintf(out, "\"splits\":%" PRIu64 ",\"coallesces\":%" PRIu64 ",", t->splits, t->coallesces);
+    statsPrintf(out, "\"slab_pages\":%zu,\"slab_mallocs\":%" PRIu64 ",\"slab_frees\":%" PRIu64
+                ",\"slab_free_bytes\":%zu,", t->slabs, t->slabMallocs, t->slabFrees, snap.slabFreeBytes);
+    statsPrintf(out, "\"buckets\":[");
+    for(fl=0; fl<FL_INDEX_COUNT; ++fl) {
+        for(sl=0; sl<SL_INDEX_COUNT; ++sl) {
+            if(!t->allocatedBlocks[fl][sl] && !snap.freeBlocks[fl][sl]) {
+                continue;
+            }
+            statsPrintf(out, "%s{\"min_size\":%zu,\"allocated_blocks\":%zu,\"allocated_bytes\":%zu,"
+                        "\"free_blocks\":%zu,\"free_bytes\":%zu}", sep, getBucketFloor(fl, sl),
+                        t->allocatedBlocks[fl][sl], t->allocatedBytes[fl][sl],
+                        snap.freeBlocks[fl][sl], snap.freeBytes[fl][sl]);
+            sep = ",";
+        }
+    }
+    statsPrintf(out, "],\"slab_classes\":[");
+    for(c=0; c<SLAB_CLASSES; ++c) {
+        statsPrintf(out, "%s{\"size\":%zu,\"in_use\":%zu}", c ? "," : "",
+                    slabClassSize[c], t->slabObjects[c]);
+    }
+    statsPrintf(out, "]}\n");
+}
+
+struct mallinfo2 mallinfo2(void) {
+    struct mallinfo2 info;
+    statsSnapshot snap;
+    takeSnapshot(&snap);
+    size_t freeBlocks;
+    size_t freeBytes = snapshotFreeBytes(&snap, &freeBlocks);
+    size_t direct = __atomic_load_n(&directBytes, __ATOMIC_RELAXED);
+    memset(&info, 0, sizeof(info));
+    info.arena = __atomic_load_n(&mappedBytes, __ATOMIC_RELAXED) - direct;
+    // like glibc, blocks in the fast bins are counted apart from the
+    // ordinary free blocks, along with free slab objects, which are about
+    // as small. fordblks is all of it
+    info.ordblks = freeBlocks - snap.fastBlocks;
+    info.smblks = snap.fastBlocks + snap.slabFreeObjects;
+    info.hblks = __atomic_load_n(&directBlocks, __ATOMIC_RELAXED);
+    info.hblkhd = direct;
+    info.usmblks = __atomic_load_n(&peakMappedBytes, __ATOMIC_RELAXED);
+    info.fsmblks = snap.fastBytes + snap.slabFreeBytes;
+    info.uordblks = snapshotAllocatedBytes(&snap);
+    info.fordblks = freeBytes + snap.slabFreeBytes;
+    info.keepcost = snap.topFree;
+    return info;
+}
+
+int clampInt(size_t n) {
+    return n > INT32_MAX ? INT32_MAX : (int)n;
+}
+
+struct mallinfo mallinfo(void) {
+    // the old one, with ints that overflow at 2 GB. clamp instead
+    struct mallinfo2 info2 = mallinfo2();
+    struct mallinfo info;
+    info.arena = clampInt(info2.arena);
+    info.ordblks = clampInt(info2.ordblks);
+    info.smblks = clampInt(info2.smblks);
+    info.hblks = clampInt(info2.hblks);
+    info.hblkhd = clampInt(info2.hblkhd);
+    info.usmblks = clampInt(info2.usmblks);
+    info.fsmblks = clampInt(info2.fsmblks);
+    info.uordblks = clampInt(info2.uordblks);
+    info.fordblks = clampInt(info2.fordblks);
+    info.keepcost = clampInt(info2.keepcost);
+    return info;
+}
+
+void malloc_stats(void) {
+    // like glibc's, to stderr, but with a lot more in it
+    char buf[4096];
+    statsOut out = {buf, sizeof(buf), 0, 2};
+    printStatsText(&out);
+    statsFlush(&out);
+}
+
+size_t scary_stats_json(char* buf, size_t size) {
+    statsOut out = {buf, size, 0, -1};
+    printStatsJson(&out);
+    if(size) {
+        buf[out.length < size ? out.length : size - 1] = 0;
+    }
+    return out.length;
+}
+
+__attribute__((destructor)) void printStatsAtExit(void) {
+    // SCARYMALLOC_STATS=1 (or text) prints malloc_stats at exit, json the
+    // same as scary_stats_json
+    char buf[4096];
+    statsOut out = {buf, sizeof(buf), 0, statsFd};
+    if(statsFd < 0) {
+        return;
+    }
+    if(statsAtExit == 1) {
+        printStatsText(&out);
+    } else {
+        printStatsJson(&out);
+    }
+    statsFlush(&out);
+}
+
+/////////////////////////
+// HEAP PROFILE
+/////////////////////////
+
+void writeProfile(statsOut* out) {
+    // the legacy text heap profile that pprof reads: the totals and sample
+    // rate, one line per sample with its stack, and the mappings, so pprof
+    // can find the symbols. pprof scales each sample back up by the odds of
+    // a block its size getting sampled. caller has the lock
+    profileSample* sample;
+    int i, j;
+    statsPrintf(out, "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n",
+                profileObjects, profileBytes, profileObjects, profileBytes, profileRate);
+    for(i=0; i<PROFILE_BUCKETS; ++i) {
+        for(sample = profileBuckets[i]; sample; sample = sample->next) {
+            statsPrintf(out, "%6d: %8zu [%6d: %8zu] @", 1, sample->size, 1, sample->size);
+            for(j=0; j<sample->depth; ++j) {
+                statsPrintf(out, " %p", sample->stack[j]);
+            }
+            statsPrintf(out, "\n");
+        }
+    }
+    statsPrintf(out, "\nMAPPED_LIBRARIES:\n");
+    statsFlush(out);
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if(maps >= 0) {
+        ssize_t n;
+        while((n = read(maps, out->buf, out->size)) > 0) {
+            out->length = n;
+            statsFlush(out);
+        }
+        close(maps);
+    }
+}
+
+void dumpProfileFile(void) {
+    // to SCARYMALLOC_PROFILE_FILE.<pid>.<n>.heap, if that's set. caller
+    // has the lock. might be in a signal handler, so no malloc
+    char path[sizeof(profilePrefix) + 32];
+    char buf[4096];
+    if(!profilePrefix[0]) {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s.%d.%04u.heap", profilePrefix, (int)getpid(), profileDumps++);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        return;
+    }
+    statsOut out = {buf, sizeof(buf), 0, fd};
+    writeProfile(&out);
+    close(fd);
+}
+
+int scary_profile_write(int fd) {
+    char buf[4096];
+    statsOut out = {buf, sizeof(buf), 0, fd};
+    if(!__atomic_load_n(&profileRate, __ATOMIC_ACQUIRE)) {
+        errno = EINVAL;
+        return -1;
+    }
+    lockProfile();
+    writeProfile(&out);
+    unlockProfile();
+    return 0;
+}
+
+void initProfiling(void) {
+    // SCARYMALLOC_PROFILE=<bytes> turns it on, sampling once per that many
+    // bytes on average. SCARYMALLOC_PROFILE_FILE is where it dumps at exit
+    // and on SCARYMALLOC_PROFILE_SIGNAL, if that's set
+    const char* env = getenv("SCARYMALLOC_PROFILE");
+    size_t rate = env ? (size_t)strtoul(env, 0, 0) : 0;
+    if(!rate) {
+        return;
+    }
+    void* table = mmap(0, PROFILE_SAMPLES*sizeof(profileSample), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(table == MAP_FAILED) {
+        return;
+    }
+    profileTable = table;
+    env = getenv("SCARYMALLOC_PROFILE_FILE");
+    if(env) {
+        strncpy(profilePrefix, env, sizeof(profilePrefix) - 1);
+    }
+    // backtrace loads libgcc the first time, which mallocs, so get that
+    // over with before there's any sampling to trip over it
+    void* frame;
+    backtrace(&frame, 1);
+    env = getenv("SCARYMALLOC_PROFILE_SIGNAL");
+    if(env && atoi(env) > 0) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = profileSignal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(atoi(env), &action, 0);
+    }
+    __atomic_store_n(&profileRate, rate, __ATOMIC_RELEASE);
+}
+
+__attribute__((destructor)) void dumpProfileAtExit(void) {
+    if(profileRate && profilePrefix[0]) {
+        lockProfile();
+        dumpProfileFile();
+        unlockProfile();
+    }
+}
+
+/////////////////////////
+// HEAP MAP
+/////////////////////////
+
+/*
+   Walking the heap: every block of every chunk of every arena, in address
+   order within each chunk, with one arena locked at a time. Each block
+   goes out as a line of CSV, and everything the boundary tags and buckets
+   promise about it gets checked on the way. Slabs and blocks with their
+   own mapping aren't anywhere we could walk, so they're left out.
+*/
+typedef struct heapWalk_t {
+    statsOut* map;      // CSV goes here, if it's set
+    statsOut* errors;   // and a line for each problem here
+    size_t problems;
+} heapWalk;
+
+void heapProblem(heapWalk* w, arena* a, void* where, const char* what) {
+    w->problems++;
+    if(w->errors) {
+        statsPrintf(w->errors, "scarymalloc: arena %d, %p: %s\n", (int)(a - arenas), where, what);
+    }
+}
+
+size_t collectFastBins(heapWalk* w, arena* a, void*** out) {
+    // every block in a's fast bins, sorted, in a mapping the caller unmaps
+    // (if there were any), so they can be told apart from allocated blocks.
+    // a broken bin could go round in circles, so don't count past what
+    // fastBytes allows
+    size_t limit = a->fastBytes/MIN_PAYLOAD + 1;
+    size_t n = 0, bytes = 0;
+    int i;
+    void* p;
+    *out = 0;
+    for(i=0; i<FASTBIN_COUNT; ++i) {
+        for(p=a->fastBins[i]; p && n < limit; p=*(void**)p) {
+            blockHeader* block = getPayloadBlock(p);
+            if(!isAllocated(block) || MASKED_VALUE(block->size) != (size_t)(i + 1)*ALIGNMENT) {
+                heapProblem(w, a, block, "block in the wrong fast bin");
+            }
+            bytes += (size_t)(i + 1)*ALIGNMENT;
+            n++;
+        }
+    }
+    if(n >= limit || bytes != a->fastBytes) {
+        heapProblem(w, a, 0, "fast bins don't add up to fastBytes");
+    }
+    if(!n) {
+        return 0;
+    }
+    void** fast = mmap(0, n*sizeof(void*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(fast == MAP_FAILED) {
+        return 0;   // they'll just look allocated
+    }
+    size_t m = 0;
+    for(i=0; i<FASTBIN_COUNT; ++i) {
+        for(p=a->fastBins[i]; p && m < n; p=*(void**)p) {
+            fast[m++] = p;
+        }
+    }
+    sortPointers(fast, n);
+    *out = fast;
+    return n;
+}
+
+int isInFastBin(void** fast, size_t n, void* p) {
+    // binary search of what collectFastBins found
+    size_t lo = 0, hi = n;
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if((uintptr_t)fast[mid] < (uintptr_t)p) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < n && fast[lo] == p;
+}
+
+void walkArena(heapWalk* w, arena* a) {
+    // caller holds a->lock
+    int index = (int)(a - arenas);
+    int fl, sl;
+    void** fast;
+    size_t numFast = collectFastBins(w, a, &fast);
+    blockHeader* top = getTop(a);
+    size_t freeBlocks = 0;
+    memoryChunk* chunk;
+    for(chunk=a->latestPhysicalChunk; chunk; chunk=chunk->older) {
+        blockHeader* fence = getChunkFence(chunk);
+        blockHeader* block = (blockHeader*)getChunkPayload(chunk);
+        int prevFree = 0;
+        if(w->map) {
+            statsPrintf(w->map, "chunk,%d,%p,%zu,\n", index, (void*)chunk, chunk->size + CHUNK_OVERHEAD);
+        }
+        while(block < fence) {
+            size_t size = MASKED_VALUE(block->size);
+            if(size % ALIGNMENT || size < MIN_PAYLOAD || getPhysicalNext(block) > fence) {
+                // can't trust it to find the next block
+                heapProblem(w, a, block, "bad block size");
+                break;
+            }
+            if(block->arena != a) {
+                heapProblem(w, a, block, "block belongs to another arena");
+            }
+            if(block->size & MMAPPEDBIT) {
+                heapProblem(w, a, block, "block in a chunk marked mmapped");
+            }
+            if(getPrevFree(block) != prevFree) {
+                heapProblem(w, a, block, "previous-free bit is wrong");
+            }
+            const char* kind;
+            if(isAllocated(block)) {
+                kind = isInFastBin(fast, numFast, getBlockPayload(block)) ? "fast" : "allocated";
+            } else {
+                kind = block == top ? "top" : "free";
+                if(getFooter(block)->size != size) {
+                    heapProblem(w, a, block, "footer doesn't match header");
+                }
+                if(prevFree) {
+                    heapProblem(w, a, block, "two free blocks in a row");
+                }
+                if(block->size & SAMPLEDBIT) {
+                    heapProblem(w, a, block, "free block marked sampled");
+                }
+                if(block == top && block->logicalPrev) {
+                    heapProblem(w, a, block, "top is in a bucket");
+                } else if(block != top && !block->logicalPrev) {
+                    heapProblem(w, a, block, "free block isn't in a bucket");
+                }
+                freeBlocks += block != top;
+            }
+            if(w->map) {
+                getBucket(size, &fl, &sl);
+                statsPrintf(w->map, "%s,%d,%p,%zu,%zu\n", kind, index, (void*)block, size, getBucketFloor(fl, sl));
+            }
+            prevFree = !isAllocated(block);
+            block = getPhysicalNext(block);
+        }
+        if(block == fence && (!isFence(fence) || fence->arena != a)) {
+            heapProblem(w, a, fence, "no fence at the end of the chunk");
+        } else if(block == fence && getPrevFree(fence) != prevFree) {
+            heapProblem(w, a, fence, "previous-free bit is wrong");
+        }
+    }
+    // and the other way round: the buckets should hold exactly the free
+    // blocks we just saw, each in the right bucket, with the bitmaps to match
+    size_t linked = 0;
+    for(fl=0; fl<FL_INDEX_COUNT; ++fl) {
+        if(!a->slBitmap[fl] != !(a->flBitmap & (1ul << fl))) {
+            heapProblem(w, a, 0, "first level bitmap is wrong");
+        }
+        for(sl=0; sl<SL_INDEX_COUNT; ++sl) {
+            blockHeader* block = a->buckets[fl][sl].logicalNext;
+            if(!block != !(a->slBitmap[fl] & (1u << sl))) {
+                heapProblem(w, a, 0, "second level bitmap is wrong");
+            }
+            for(; block && linked <= freeBlocks; block=block->logicalNext) {
+                int bfl, bsl;
+                linked++;
+                getBucket(MASKED_VALUE(block->size), &bfl, &bsl);
+                if(isAllocated(block)) {
+                    heapProblem(w, a, block, "allocated block in a bucket");
+                } else if(bfl != fl || bsl != sl) {
+                    heapProblem(w, a, block, "block in the wrong bucket");
+                }
+                if(block->logicalNext && block->logicalNext->logicalPrev != block) {
+                    heapProblem(w, a, block, "bucket links are broken");
+                }
+            }
+        }
+    }
+    if(linked != freeBlocks) {
+        heapProblem(w, a, 0, "buckets don't hold the same blocks as the chunks");
+    }
+    if(fast) {
+        munmap(fast, numFast*sizeof(void*));
+    }
+}
+
+size_t walkHeap(statsOut* map, statsOut* errors) {
+    // returns how many problems it found
+    heapWalk w = {map, errors, 0};
+    int i;
+    if(map) {
+        statsPrintf(map, "kind,arena,address,size,bucket\n");
+    }
+    if(!__atomic_load_n(&arenasReady, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    for(i=0; i<numArenas; ++i) {
+        lockArena(&arenas[i]);
+        walkArena(&w, &arenas[i]);
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    return w.problems;
+}
+
+size_t scary_heap_write(int fd) {
+    char buf[4096];
+    statsOut out = {buf, sizeof(buf), 0, fd};
+    size_t problems = walkHeap(&out, 0);
+    statsFlush(&out);
+    return problems;
+}
+
+size_t scary_heap_check(int fd) {
+    char buf[4096];
+    statsOut out = {buf, sizeof(buf), 0, fd};
+    size_t problems = walkHeap(0, fd >= 0 ? &out : 0);
+    if(fd >= 0) {
+        statsFlush(&out);
+    }
+    return problems;
+}
+
+__attribute__((destructor)) void writeHeapMapAtExit(void) {
+    // to SCARYMALLOC_HEAP_MAP.<pid>.csv
+    char path[sizeof(heapMapPrefix) + 32];
+    if(!heapMapPrefix[0]) {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s.%d.csv", heapMapPrefix, (int)getpid());
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd >= 0) {
+        scary_heap_write(fd);
+        close(fd);
+    }
+}
+
+#ifdef TESTIT
+
+#include <stdio.h>
+
+int main() {
+    // make sure the compiler isn't doing any weird padding
+    // and everything will align right
+    assert(sizeof(blockHeader) == (3*sizeof(void*) + sizeof(size_t)));
+    assert(sizeof(blockFooter) == sizeof(size_t));
+    assert(BLOCK_OVERHEAD == 2*sizeof(size_t));
+    assert(BLOCK_OVERHEAD % ALIGNMENT == 0);
+    // a free block's links, purge info and footer all fit in the smallest payload
+    assert(sizeof(blockHeader) - BLOCK_OVERHEAD + sizeof(purgeInfo) + sizeof(blockFooter) <= MIN_PAYLOAD);
+    assert(MIN_PAYLOAD % ALIGNMENT == 0);
+    assert(sizeof(memoryChunk) == (sizeof(size_t) + sizeof(memoryChunk*)));
+    assert(sizeof(memoryChunk) % ALIGNMENT == 0);
     printf("1 -align-> %lu\n", next_aligned_value(1));
     printf("10 -align-> %lu\n", next_aligned_value(10));
     printf("16 -align-> %lu\n", next_aligned_value(16));
@@ -523,20 +3679,64 @@ int main() {
     printf("sizeof(size_t) %lu\n", sizeof(size_t));
     printf("sizeof(void*) %lu\n", sizeof(void*));
     printf("sizeof(uintptr_t) %lu\n", sizeof(uintptr_t));
-    printf("log2(9) = %lu\n", mylog2(9));
-    printf("s=%d --> b=%d\n", 1, getBucket(1));
-    printf("s=%d --> b=%d\n", 7, getBucket(7));
-    printf("s=%d --> b=%d\n", 8, getBucket(8));
-    printf("s=%d --> b=%d\n", 9, getBucket(9));
-    printf("s=%d --> b=%d\n", 15, getBucket(15));
-    printf("s=%d --> b=%d\n", 16, getBucket(16));
-    printf("s=%d --> b=%d\n", 17, getBucket(17));
-    printf("s=%d --> b=%d\n", 31, getBucket(31));
-    printf("s=%d --> b=%d\n", 32, getBucket(32));
-    printf("s=%d --> b=%d\n", 33, getBucket(33));
-    printf("s=%d --> b=%d\n", 63, getBucket(63));
-    printf("s=%d --> b=%d\n", 64, getBucket(64));
-    printf("s=%d --> b=%d\n", 65, getBucket(65));
+    printf("log2(9) = %d\n", floorLog2(9));
+    size_t sizes[] = {16, 32, 240, 256, 272, 511, 512, 4096, 4097, 1ul << 41};
+    size_t j;
+    for(j=0; j<sizeof(sizes)/sizeof(sizes[0]); ++j) {
+        int fl, sl, sfl, ssl;
+        getBucket(sizes[j], &fl, &sl);
+        getSearchBucket(sizes[j], &sfl, &ssl);
+        printf("s=%lu --> b=(%d,%d), search from (%d,%d)\n", sizes[j], fl, sl, sfl, ssl);
+    }
+    // buckets never go backwards, and anything in a search bucket fits
+    size_t t;
+    int lastFl = 0, lastSl = 0;
+    for(t=ALIGNMENT; t<(1ul << 20); t+=ALIGNMENT) {
+        int fl, sl, sfl, ssl;
+        getBucket(t, &fl, &sl);
+        assert(fl > lastFl || (fl == lastFl && sl >= lastSl));
+        lastFl = fl;
+        lastSl = sl;
+        getSearchBucket(t, &sfl, &ssl);
+        assert(sfl > fl || (sfl == fl && ssl >= sl));
+        // the smallest size in the search bucket has to fit
+        size_t floor = getBucketFloor(sfl, ssl);
+        assert(floor >= t || (sfl == fl && ssl == sl && floor + ALIGNMENT > t));
+    }
+    printf("buckets ok\n");
+    // every small size maps to the smallest slab class that holds it
+    assert(SLAB_HEADER_SIZE % ALIGNMENT == 0);
+    size_t s;
+    for(s=ALIGNMENT; s<=SLAB_MAX_SIZE; s+=ALIGNMENT) {
+        unsigned int c = slabClassOf[s/ALIGNMENT];
+        assert(slabClassSize[c] >= s);
+        assert(c == 0 || slabClassSize[c-1] < s);
+    }
+    printf("slab classes ok\n");
+    // close enough to log2 for picking sample points
+    double xs[] = {1, 0.5, 8, 0.1, 1e-9, 0.999999, 1.5};
+    double logs[] = {0, -1, 3, -3.321928, -29.897353, -0.0000014, 0.584963};
+    for(j=0; j<sizeof(xs)/sizeof(xs[0]); ++j) {
+        double err = approxLog2(xs[j]) - logs[j];
+        assert(err < 0.01 && err > -0.01);
+    }
+    printf("approxLog2 ok\n");
+    // a heap that's seen some use still holds together
+    void* ps[1000];
+    for(j=0; j<1000; ++j) {
+        ps[j] = malloc(j*37 % 5000 + 1);
+    }
+    for(j=0; j<1000; j+=3) {
+        free(ps[j]);
+    }
+    assert(scary_heap_check(2) == 0);
+    for(j=1; j<1000; ++j) {
+        if(j % 3) {
+            free(ps[j]);
+        }
+    }
+    assert(scary_heap_check(2) == 0);
+    printf("heap check ok\n");
 }
 
 #endif
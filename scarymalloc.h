@@ -0,0 +1,118 @@
+#ifndef SCARYMALLOC_H
+#define SCARYMALLOC_H
+
+/*
+   Things scarymalloc has besides the usual malloc family. None of this is
+   needed just to LD_PRELOAD it.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+   Batches. scary_malloc_batch allocates n objects of size bytes into
+   ptrs, all under one lock, and returns how many it got; if that's less
+   than n, errno is ENOMEM. Each one is freed like any other, or all at
+   once with scary_free_batch, which frees the n pointers in ptrs (nulls
+   are fine) and leaves ptrs in some other order.
+*/
+size_t scary_malloc_batch(size_t size, size_t n, void** ptrs);
+void scary_free_batch(void** ptrs, size_t n);
+
+/*
+   Regions, for lots of objects that all die at the same time. Allocations
+   from a region are 16-aligned, like malloc's, but are never freed one at
+   a time (don't pass them to free or realloc): scary_region_reset frees
+   everything allocated from the region so far, and keeps one block of
+   memory around to start over with; scary_region_destroy frees it all,
+   region included. Create and alloc return 0 when out of memory. A region
+   isn't thread safe, though which thread uses it can change.
+*/
+typedef struct scaryRegion_t scaryRegion;
+
+scaryRegion* scary_region_create(void);
+void* scary_region_alloc(scaryRegion* r, size_t size);
+void scary_region_reset(scaryRegion* r);
+void scary_region_destroy(scaryRegion* r);
+
+/*
+   Event tracing. Only there if scarymalloc.c is built with -D SCARY_TRACE.
+   Every thread records one of these per call in a buffer of its own,
+   without any locking. If SCARYMALLOC_TRACE names a file, full buffers are
+   appended to it as raw structs (so in the byte order and layout of the
+   machine that wrote them); otherwise each buffer is just a ring of the
+   latest events, for looking at from a debugger.
+*/
+#define SCARY_TRACE_MALLOC 1
+#define SCARY_TRACE_FREE 2
+#define SCARY_TRACE_CALLOC 3
+#define SCARY_TRACE_REALLOC 4    // ptr 0 and size 0 if it just freed old
+#define SCARY_TRACE_MEMALIGN 5   // the alignment is in old
+
+// flags
+#define SCARY_TRACE_NEWCHUNK 1   // had to get more memory from the kernel
+
+// bucket is fl*16 + sl for blocks (see getBucket), or one of these
+#define SCARY_TRACE_SLAB 0x8000     // | the slab size class
+#define SCARY_TRACE_DIRECT 0xffff   // block with its own mapping
+#define SCARY_TRACE_NONE 0xfffe     // nothing was allocated
+
+typedef struct scaryTraceEvent_t {
+    uint64_t time;     // cycle counter where there is one, else ns
+    uint64_t ptr;      // what got returned, or freed
+    uint64_t old;      // pointer passed to realloc
+    uint64_t size;     // as asked for, not rounded
+    uint32_t thread;   // numbered from 0 in the order threads first trace
+    uint8_t op;
+    uint8_t flags;
+    uint16_t bucket;
+} scaryTraceEvent;
+
+// write out the calling thread's events now, instead of when its buffer
+// fills up or it exits
+void scary_trace_flush(void);
+
+/*
+   Statistics. mallinfo2 and malloc_stats (from <malloc.h>) work as usual;
+   this is everything malloc_stats knows, as one line of JSON: counters
+   added up over all the arenas, plus allocated and free blocks and bytes
+   for every bucket that has any. Writes at most size bytes, including the
+   terminating 0, and returns the length the whole thing needs, like
+   snprintf does.
+*/
+size_t scary_stats_json(char* buf, size_t size);
+
+/*
+   Heap profile. Only does anything if SCARYMALLOC_PROFILE is set to a
+   sample rate in bytes. Writes what's sampled of the live heap right now
+   to fd, in the text format pprof reads as a heap profile (run it with
+   the program, so it can find the symbols). Returns 0, or -1 if profiling
+   is off.
+*/
+int scary_profile_write(int fd);
+
+/*
+   Heap map. scary_heap_write writes every block in every arena's chunks
+   to fd as CSV, with a header line and then one line per chunk or block:
+
+     kind,arena,address,size,bucket
+
+   kind is chunk, allocated, free, top (the free block at the end of an
+   arena's latest chunk), or fast (freed, but not coallesced yet). A chunk's
+   address and size are the whole mapping; it's followed by its blocks in
+   address order, where address is the block's header and size is its
+   payload, which comes BLOCK_OVERHEAD (16) bytes after it. bucket is the
+   smallest size in the block's bucket. Blocks in thread caches show up as
+   allocated, and slabs and blocks with mappings of their own don't show up.
+   heapmap.py turns this into histograms and a picture of each chunk.
+   SCARYMALLOC_HEAP_MAP=<prefix> writes one to <prefix>.<pid>.csv at exit.
+
+   Both of these also check that the heap is consistent (headers, footers
+   and flags agree, and the buckets hold exactly the free blocks) and
+   return the number of problems found. scary_heap_check writes a line about
+   each to fd, unless fd is -1.
+*/
+size_t scary_heap_write(int fd);
+size_t scary_heap_check(int fd);
+
+#endif
@@ -0,0 +1,257 @@
+#ifndef SCARYMALLOC_HPP
+#define SCARYMALLOC_HPP
+
+/*
+   Pools for C++ objects of one type, header only (C++17). Objects are cut
+   from runs of RUN_SIZE bytes with a bump pointer, and freed ones are kept
+   on a stack to be handed out again, so there's no header per object, no
+   bucket lookup, and objects that are allocated together sit together.
+   The runs themselves are just big mallocs, so with scarymalloc.so
+   preloaded they're blocks from its arenas like anything else.
+
+   scary::pool<T> is a pool you own: not thread safe, and everything it
+   ever handed out goes back when it's destroyed. scary::allocator<T> is
+   for STL containers (node-based ones, mostly): single objects come from
+   one pool per size and alignment shared by the whole program, behind a
+   spinlock, and arrays go to operator new like they would anyway.
+*/
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <sched.h>
+#include <utility>
+
+namespace scary {
+
+namespace detail {
+
+// bytes asked for at a time. a 16-byte block header is nothing next to
+// this, and it's well under the size where malloc would mmap it
+const std::size_t RUN_SIZE = 64*1024;
+
+// the first thing in every run, and in every free slot
+struct link {
+    link* next;
+};
+
+/*
+   Slots of Size bytes on an Align boundary. No locking; that's up to
+   whoever owns it.
+*/
+template<std::size_t Size, std::size_t Align>
+class slots {
+public:
+    static_assert(Align && !(Align & (Align - 1)), "alignment has to be a power of two");
+    static_assert(Align <= 4096, "alignment too big for a pool");
+
+    // a freed slot has to be able to hold the free stack's link
+    static constexpr std::size_t slotSize =
+        ((Size > sizeof(link) ? Size : sizeof(link)) + Align - 1) & ~(Align - 1);
+    // slots start after the run's link, rounded up to Align
+    static constexpr std::size_t firstSlot = (sizeof(link) + Align - 1) & ~(Align - 1);
+    static constexpr std::size_t runSize =
+        firstSlot + slotSize > RUN_SIZE ? firstSlot + slotSize : RUN_SIZE;
+
+    slots() : freeSlots(nullptr), next(nullptr), end(nullptr), runs(nullptr) {}
+    slots(const slots&) = delete;
+    slots& operator=(const slots&) = delete;
+
+    ~slots() {
+        while(runs) {
+            link* r = runs;
+            runs = r->next;
+            std::free(r);
+        }
+    }
+
+    void* get() {
+        // a freed slot if there is one, since it's probably still in cache
+        if(freeSlots) {
+            link* p = freeSlots;
+            freeSlots = p->next;
+            return p;
+        }
+        if(next == end && !newRun()) {
+            return nullptr;
+        }
+        void* p = next;
+        next += slotSize;
+        return p;
+    }
+
+    void put(void* p) {
+        link* l = static_cast<link*>(p);
+        l->next = freeSlots;
+        freeSlots = l;
+    }
+
+private:
+    bool newRun() {
+        void* m;
+        if(Align <= alignof(std::max_align_t)) {
+            m = std::malloc(runSize);
+        } else {
+            m = std::aligned_alloc(Align, (runSize + Align - 1) & ~(Align - 1));
+        }
+        if(!m) {
+            return false;
+        }
+        link* r = static_cast<link*>(m);
+        r->next = runs;
+        runs = r;
+        next = static_cast<char*>(m) + firstSlot;
+        // only whole slots; whatever's after the last one just goes unused
+        end = next + (runSize - firstSlot) / slotSize * slotSize;
+        return true;
+    }
+
+    link* freeSlots;
+    char* next;    // bump pointer into the newest run
+    char* end;
+    link* runs;    // every run, newest first, to free them all at the end
+};
+
+/*
+   The slots every scary::allocator with this size and alignment shares.
+   Made once and never destroyed: containers can outlive any static
+   destructor order we'd pick, and a slot can be freed from any thread at
+   any time, so the runs can never go back.
+*/
+template<std::size_t Size, std::size_t Align>
+class sharedSlots {
+public:
+    static void* get() {
+        sharedSlots& s = instance();
+        s.lock();
+        void* p = s.pool.get();
+        s.unlock();
+        return p;
+    }
+
+    static void put(void* p) {
+        sharedSlots& s = instance();
+        s.lock();
+        s.pool.put(p);
+        s.unlock();
+    }
+
+private:
+    static sharedSlots& instance() {
+        static sharedSlots* s = new sharedSlots;
+        return *s;
+    }
+
+    void lock() {
+        // only ever held for a push or pop, or one malloc
+        while(locked.exchange(true, std::memory_order_acquire)) {
+            sched_yield();
+        }
+    }
+
+    void unlock() {
+        locked.store(false, std::memory_order_release);
+    }
+
+    std::atomic<bool> locked{false};
+    slots<Size, Align> pool;
+};
+
+}
+
+template<class T>
+class pool {
+public:
+    pool() = default;
+    pool(const pool&) = delete;
+    pool& operator=(const pool&) = delete;
+
+    // raw memory for one T, or std::bad_alloc
+    T* allocate() {
+        void* p = slots.get();
+        if(!p) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p) noexcept {
+        slots.put(p);
+    }
+
+    // allocate and construct, or destroy and deallocate
+    template<class... Args>
+    T* create(Args&&... args) {
+        T* p = allocate();
+        try {
+            return ::new(static_cast<void*>(p)) T(std::forward<Args>(args)...);
+        } catch(...) {
+            deallocate(p);
+            throw;
+        }
+    }
+
+    void destroy(T* p) noexcept {
+        if(p) {
+            p->~T();
+            deallocate(p);
+        }
+    }
+
+private:
+    detail::slots<sizeof(T), alignof(T)> slots;
+};
+
+template<class T>
+class allocator {
+public:
+    typedef T value_type;
+
+    allocator() noexcept {}
+    template<class U>
+    allocator(const allocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n) {
+        if(n == 1) {
+            void* p = detail::sharedSlots<sizeof(T), alignof(T)>::get();
+            if(!p) {
+                throw std::bad_alloc();
+            }
+            return static_cast<T*>(p);
+        }
+        if(n > std::size_t(-1) / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        if constexpr(alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+        } else {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept {
+        if(n == 1) {
+            detail::sharedSlots<sizeof(T), alignof(T)>::put(p);
+        } else if constexpr(alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            ::operator delete(p, n * sizeof(T), std::align_val_t(alignof(T)));
+        } else {
+            ::operator delete(p, n * sizeof(T));
+        }
+    }
+};
+
+// every allocator can free what any other allocated
+template<class T, class U>
+bool operator==(const allocator<T>&, const allocator<U>&) noexcept {
+    return true;
+}
+
+template<class T, class U>
+bool operator!=(const allocator<T>&, const allocator<U>&) noexcept {
+    return false;
+}
+
+}
+
+#endif
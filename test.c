@@ -1,5 +1,18 @@
 #include "stdlib.h"
 #include "stdio.h"
+#include "malloc.h"
+#include "stdint.h"
+#include "scarymalloc.h"
+
+// these are only there when scarymalloc is preloaded. under any other
+// malloc they stay null, and the tests that use them are skipped
+#pragma weak scary_malloc_batch
+#pragma weak scary_free_batch
+#pragma weak scary_region_create
+#pragma weak scary_region_alloc
+#pragma weak scary_region_reset
+#pragma weak scary_region_destroy
+#pragma weak scary_heap_check
 
 #ifndef NUMPTRS
 #define NUMPTRS 10
@@ -21,6 +34,170 @@ void check(char* buf, size_t s) {
     }
 }
 
+void testReallocOverflow(void) {
+    // growing a block by an absurd amount has to fail and leave it alone,
+    // even when it's right at the end of the heap and could be grown in
+    // place. keep allocating until some of them land there
+    char* blocks[200];
+    volatile size_t huge = SIZE_MAX - 20;
+    size_t i;
+    for(i=0; i<200; ++i) {
+        blocks[i] = malloc(2000);
+        use(blocks[i], 2000);
+        if(realloc(blocks[i], huge)) {
+            printf("realloc to %lu bytes worked\n", huge);
+            break;
+        }
+        check(blocks[i], 2000);
+    }
+    while(i) {
+        free(blocks[--i]);
+    }
+}
+
+void testTop(void) {
+    // a malloc too big for anything in the buckets is carved off the front
+    // of the top (the free end of the latest chunk, which mallinfo2 calls
+    // keepcost), and freeing it merges it straight back in. on a fresh
+    // heap a malloc bigger than the top gets a new chunk, and with it a
+    // top bigger than anything left behind
+    size_t top = mallinfo2().keepcost;
+    if(top < 120000) {
+        free(malloc(top + 4096));
+        top = mallinfo2().keepcost;
+    }
+    // leave enough behind for the top to stay a block, and stay clear
+    // of the mmap threshold
+    size_t s = top - 128 < 120000 ? (top - 128) & ~(size_t)15 : 120000;
+    char* p = malloc(s);
+    if(mallinfo2().keepcost != top - s - 16) {
+        printf("malloc(%lu) didn't come off a top of %lu, it's %lu now\n",
+               s, top, mallinfo2().keepcost);
+    }
+    use(p, s);
+    free(p);
+    if(mallinfo2().keepcost != top) {
+        printf("free didn't merge back into the top, it's %lu, not %lu\n",
+               mallinfo2().keepcost, top);
+    }
+    if(scary_heap_check(2)) {
+        printf("heap's broken after using the top\n");
+    }
+}
+
+void testFastBins(void) {
+    // a freed block too big for the thread cache waits in a fast bin, and
+    // the next malloc of exactly that size gets it straight back
+    char* run[40];
+    char* hogs[256];
+    size_t i, nhogs = 0;
+    char* p = malloc(2000);
+    size_t fast = mallinfo2().smblks;
+    free(p);
+    if(mallinfo2().smblks != fast + 1) {
+        printf("a freed 2000 byte block isn't in a fast bin\n");
+    }
+    char* q = malloc(2000);
+    if(q != p) {
+        printf("malloc didn't reuse the block in the fast bin\n");
+    }
+    // blocks freed into the fast bins, and then a malloc bigger than any
+    // free block or the top, which has to coallesce them before it asks
+    // for a new chunk
+    for(i=0; i<40; ++i) {
+        run[i] = malloc(2000);
+    }
+    while(mallinfo2().keepcost >= 70000 && nhogs < 256) {
+        hogs[nhogs++] = malloc(70000);
+    }
+    fast = mallinfo2().smblks;
+    for(i=0; i<40; ++i) {
+        free(run[i]);
+    }
+    if(mallinfo2().smblks != fast + 40) {
+        printf("40 freed blocks didn't all go in the fast bins\n");
+    }
+    char* big = malloc(70000);
+    if(mallinfo2().smblks > fast) {
+        printf("the fast bins weren't coallesced for a big malloc\n");
+    }
+    free(big);
+    for(i=0; i<nhogs; ++i) {
+        free(hogs[i]);
+    }
+    free(q);
+    if(scary_heap_check(2)) {
+        printf("heap's broken after the fast bins\n");
+    }
+}
+
+void testBatch(void) {
+    // a batch is carved out of one free block, and freeing it all at once
+    // puts that back together. the first one may need a new chunk, which
+    // leaves the old one's free end behind, so count from the second
+    void* ptrs[64];
+    size_t i, got, round;
+    size_t freeBlocks = 0;
+    for(round=0; round<2; ++round) {
+        got = scary_malloc_batch(2000, 64, ptrs);
+        if(got != 64) {
+            printf("scary_malloc_batch got %lu of 64\n", got);
+        }
+        for(i=0; i<got; ++i) {
+            use(ptrs[i], 2000);
+        }
+        for(i=0; i<got; ++i) {
+            check(ptrs[i], 2000);
+        }
+        scary_free_batch(ptrs, got);
+        if(round && mallinfo2().ordblks > freeBlocks) {
+            printf("batch left %lu free blocks, not %lu\n", mallinfo2().ordblks, freeBlocks);
+        }
+        freeBlocks = mallinfo2().ordblks;
+    }
+    if(scary_heap_check(2)) {
+        printf("heap's broken after a batch\n");
+    }
+}
+
+void testRegion(void) {
+    // 200K of objects doesn't fit in a region's first block, so some of
+    // them come from the next one. none of them can overlap, before or
+    // after a reset (which keeps the biggest block, so they all fit then)
+    char* objs[200];
+    size_t i, round, blocks;
+    scaryRegion* r = scary_region_create();
+    if(!r) {
+        printf("scary_region_create failed\n");
+        return;
+    }
+    for(round=0; round<2; ++round) {
+        blocks = 1;
+        for(i=0; i<200; ++i) {
+            objs[i] = scary_region_alloc(r, 1000);
+            if(!objs[i] || (uintptr_t)objs[i] % 16) {
+                printf("region gave back %p\n", objs[i]);
+                return;
+            }
+            if(i && objs[i] != objs[i-1] + 1008) {
+                blocks++;
+            }
+            use(objs[i], 1000);
+        }
+        for(i=0; i<200; ++i) {
+            check(objs[i], 1000);
+        }
+        if(!round && blocks < 2) {
+            printf("200 region objects all fit in one block\n");
+        }
+        scary_region_reset(r);
+    }
+    scary_region_destroy(r);
+    if(scary_heap_check(2)) {
+        printf("heap's broken after a region\n");
+    }
+}
+
 int main(int argc, char** args) {
     void* ptrs[NUMPTRS];
     size_t sizes[NUMPTRS];
@@ -30,6 +207,33 @@ int main(int argc, char** args) {
         ptrs[i] = 0;
         sizes[i] = 0;
     }
+    // volatile, so the compiler can't see the overflow coming and warn
+    volatile size_t huge = SIZE_MAX/2;
+    if(calloc(huge, 3)) {
+        printf("calloc didn't catch an overflow\n");
+    }
+    // asking for nothing at any alignment still gets a pointer of its own
+    for(i=0; i<3; ++i) {
+        size_t alignment = (size_t[]){8, 16, 64}[i];
+        void* p = 0;
+        if(posix_memalign(&p, alignment, 0) || !p) {
+            printf("posix_memalign failed for size 0, alignment %lu\n", alignment);
+        }
+        free(p);
+        if(!(p = aligned_alloc(alignment, 0))) {
+            printf("aligned_alloc failed for size 0, alignment %lu\n", alignment);
+        }
+        free(p);
+    }
+    // scarymalloc's own features, while the heap's still fresh enough
+    // for the top and fast bin tests to know what's in the buckets
+    if(scary_heap_check) {
+        testTop();
+        testFastBins();
+        testBatch();
+        testRegion();
+    }
+    testReallocOverflow();
     // read integers off stdin
     //printf("allocating.\n");
     i = 0;
@@ -37,10 +241,42 @@ int main(int argc, char** args) {
         //printf("allocating %d\n", n);
         if(ptrs[i]) {
             check(ptrs[i], sizes[i]);
+        }
+        if(ptrs[i] && i % 2) {
+            // half the slots get resized instead, which has to keep
+            // whatever still fits
+            ptrs[i] = realloc(ptrs[i], n);
+            check(ptrs[i], sizes[i] < n ? sizes[i] : n);
+        } else if(i % 8 == 4) {
+            // and an eighth come from calloc, which has to clear whatever
+            // the last owner of the memory left in it
+            size_t j;
+            free(ptrs[i]);
+            ptrs[i] = calloc(1, n);
+            for(j=0; j<n; ++j) {
+                if(((char*)ptrs[i])[j]) {
+                    printf("calloc'd %p isn't zero at %lu\n", ptrs[i], j);
+                    break;
+                }
+            }
+        } else if(i % 4 == 2) {
+            // and a quarter of them get aligned
+            size_t alignment = (size_t)32 << (n % 8);
             free(ptrs[i]);
+            if(posix_memalign(&ptrs[i], alignment, n)) {
+                printf("posix_memalign failed for size %lu\n", n);
+                ptrs[i] = 0;
+            } else if((size_t)ptrs[i] % alignment) {
+                printf("%p isn't aligned to %lu\n", ptrs[i], alignment);
+            }
+        } else {
+            free(ptrs[i]);
+            ptrs[i] = malloc(n);
+        }
+        if(malloc_usable_size(ptrs[i]) < n) {
+            printf("usable size of %p is less than %lu\n", ptrs[i], n);
         }
         sizes[i] = n;
-        ptrs[i] = malloc(n);
         use(ptrs[i], n);  // twiddle the bits
         // increment i
         //printf("incrementing\n");
@@ -50,6 +286,9 @@ int main(int argc, char** args) {
     for(i=0; i<NUMPTRS; ++i) {
         free(ptrs[i]);
     }
+    if(scary_heap_check && scary_heap_check(2)) {
+        printf("heap's broken at the end\n");
+    }
     //printf("done. cool!\n");
     return 0;
 }
@@ -0,0 +1,94 @@
+// makes sure scarymalloc.hpp compiles, and that pools and allocators hand
+// out memory that works. prints anything that's wrong
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include "scarymalloc.hpp"
+
+static int live = 0;
+
+struct thing {
+    long a, b;
+    explicit thing(long n) : a(n), b(-n) { live++; }
+    ~thing() { live--; }
+};
+
+struct alignas(64) wide {
+    char bytes[64];
+};
+
+struct grumpy {
+    grumpy() { throw std::runtime_error("no"); }
+};
+
+int main() {
+    int failed = 0;
+
+    scary::pool<thing> things;
+    thing* p[1000];
+    for(long i=0; i<1000; ++i) {
+        p[i] = things.create(i);
+    }
+    for(long i=0; i<1000; ++i) {
+        if(p[i]->a != i || p[i]->b != -i) {
+            std::printf("pool object %ld was overwritten\n", i);
+            failed = 1;
+        }
+    }
+    // freed objects are the first ones handed back out
+    things.destroy(p[500]);
+    if(things.create(7) != p[500]) {
+        std::printf("pool didn't reuse a freed object\n");
+        failed = 1;
+    }
+    for(long i=0; i<1000; ++i) {
+        things.destroy(p[i]);
+    }
+    if(live) {
+        std::printf("%d things weren't destroyed\n", live);
+        failed = 1;
+    }
+
+    scary::pool<wide> wides;
+    for(int i=0; i<100; ++i) {
+        if((std::uintptr_t)wides.allocate() % alignof(wide)) {
+            std::printf("pool object isn't %zu-aligned\n", alignof(wide));
+            failed = 1;
+        }
+    }
+
+    // a constructor that throws gives its memory back
+    scary::pool<grumpy> grumpies;
+    void* first = grumpies.allocate();
+    grumpies.deallocate(static_cast<grumpy*>(first));
+    try {
+        grumpies.create();
+    } catch(const std::runtime_error&) {
+    }
+    if(grumpies.allocate() != first) {
+        std::printf("pool lost an object to a throwing constructor\n");
+        failed = 1;
+    }
+
+    typedef std::pair<const int, std::string> entry;
+    std::map<int, std::string, std::less<int>, scary::allocator<entry>> m;
+    for(int i=0; i<10000; ++i) {
+        m[i] = std::to_string(i);
+    }
+    for(int i=0; i<10000; i+=2) {
+        m.erase(i);
+    }
+    for(int i=0; i<10000; ++i) {
+        auto it = m.find(i);
+        if((i % 2) != (it != m.end()) || (it != m.end() && it->second != std::to_string(i))) {
+            std::printf("map with scary::allocator is wrong at %d\n", i);
+            failed = 1;
+            break;
+        }
+    }
+
+    return failed;
+}